@@ -0,0 +1,104 @@
+import com.sun.jna.Native;
+
+import java.lang.foreign.Arena;
+import java.lang.foreign.MemorySegment;
+
+/*
+ * Per-call overhead of the JNA binding against the FFM one, in the manner of a
+ * JMH average-time benchmark: warmup iterations, then timed iterations reported
+ * as ns/op with their spread. Both bindings drive the same loaded libraw.so.
+ *
+ * Usage: java --enable-native-access=ALL-UNNAMED -cp jna.jar:. RawBench device [record_size] [sub_sectors]
+ * WARNING: writes to the device.
+ */
+public class RawBench {
+  static final int WARMUP_ITERATIONS = 5;
+  static final int MEASURE_ITERATIONS = 5;
+  static final long ITERATION_NS = 1_000_000_000L;
+  static final long DIVISIONS = 4096;
+
+  interface Op {
+    long call(long i);
+  }
+
+  static volatile long sink;
+
+  // Run op in batches until an iteration's time is up; return ns/op.
+  static double iteration(Op op) {
+    long ops = 0, acc = 0, start = System.nanoTime(), elapsed;
+
+    do {
+      for (int k = 0; k < 1024; k++, ops++) {
+        acc += op.call(ops);
+      }
+      elapsed = System.nanoTime() - start;
+    } while (elapsed < ITERATION_NS);
+
+    sink = acc;
+    return (double) elapsed / ops;
+  }
+
+  static void bench(String name, Op op) {
+    double[] scores = new double[MEASURE_ITERATIONS];
+    double mean = 0, var = 0;
+
+    for (int i = 0; i < WARMUP_ITERATIONS; i++) {
+      iteration(op);
+    }
+    for (int i = 0; i < MEASURE_ITERATIONS; i++) {
+      scores[i] = iteration(op);
+      mean += scores[i];
+    }
+    mean /= MEASURE_ITERATIONS;
+    for (double s : scores) {
+      var += (s - mean) * (s - mean);
+    }
+
+    System.out.printf("%-16s avgt %4d %12.3f ± %9.3f  ns/op%n", name, MEASURE_ITERATIONS, mean,
+        Math.sqrt(var / (MEASURE_ITERATIONS - 1)));
+  }
+
+  public static void main(String[] args) {
+    String device = args[0];
+    int recordSize = args.length > 1 ? Integer.parseInt(args[1]) : 512;
+    int subSectors = args.length > 2 ? Integer.parseInt(args[2]) : 8;
+    int subSectorBytes = recordSize / subSectors;
+
+    RawJNA jna = (RawJNA) Native.loadLibrary("raw", RawJNA.class);
+
+    if (! RawFFM.config(device, recordSize, subSectors)) {
+      System.out.println("=> ERROR: couldn't configure " + device);
+      return;
+    }
+
+    String message = "x".repeat(subSectorBytes - 1);
+    Arena arena = Arena.ofShared();
+    MemorySegment payload = arena.allocateFrom(message);
+    MemorySegment dest = arena.allocate(subSectorBytes, 64);
+
+    for (long d = 0; d < DIVISIONS; d++) {
+      RawFFM.erase(d);
+      RawFFM.write(d, payload, subSectorBytes);
+    }
+
+    System.out.printf("%-16s %4s %4s %12s   %9s  %s%n", "Benchmark", "Mode", "Cnt", "Score", "StdDev", "Units");
+
+    // Erase past the written range only flips a bitmap bit: almost pure call cost.
+    bench("erase.jna", i -> { jna.eraseSubsectorJNA(DIVISIONS + (i & 1023)); return i; });
+    bench("erase.ffm", i -> { RawFFM.erase(DIVISIONS + (i & 1023)); return i; });
+
+    bench("read.jna", i -> jna.readJNA(i % DIVISIONS, subSectorBytes).length());
+    bench("read.ffm", i -> RawFFM.readInto(i % DIVISIONS, dest, subSectorBytes));
+
+    bench("write.jna", i -> {
+      jna.eraseSubsectorJNA(i % DIVISIONS);
+      return jna.writeJNA(i % DIVISIONS, message, subSectorBytes);
+    });
+    bench("write.ffm", i -> {
+      RawFFM.erase(i % DIVISIONS);
+      return RawFFM.write(i % DIVISIONS, payload, subSectorBytes) ? 1 : 0;
+    });
+
+    arena.close();
+  }
+}
@@ -0,0 +1,422 @@
+import java.lang.foreign.Arena;
+import java.lang.foreign.FunctionDescriptor;
+import java.lang.foreign.Linker;
+import java.lang.foreign.MemorySegment;
+import java.lang.foreign.SymbolLookup;
+import java.lang.invoke.MethodHandle;
+import java.lang.invoke.MethodHandles;
+import java.lang.invoke.MethodType;
+
+import static java.lang.foreign.ValueLayout.ADDRESS;
+import static java.lang.foreign.ValueLayout.JAVA_BOOLEAN;
+import static java.lang.foreign.ValueLayout.JAVA_INT;
+import static java.lang.foreign.ValueLayout.JAVA_LONG;
+
+/*
+ * Binding of the raw.c exports through the Foreign Function & Memory API (Java 22+).
+ * Downcall handles are bound once with exact C signatures and take only
+ * primitives and MemorySegments, so payloads stay off-heap and no String or
+ * array is marshalled per call. Every export RawJNA maps is bound except
+ * readJNA, whose String result readInto() replaces. None are linked as
+ * critical: even the bitmap calls can block, on the first call's counters
+ * setup or the compressed map's lock, and a critical call blocking would
+ * stall the JVM's safepoints.
+ *
+ * The library is found with dlopen: put libraw.so on LD_LIBRARY_PATH or point
+ * -Draw.library at it.
+ */
+public final class RawFFM {
+  // Status codes of the int returning calls.
+  public static final int RAW_OK = 0;
+  public static final int RAW_ERR_IO = -1;
+  public static final int RAW_ERR_NOT_FOUND = -2;
+  public static final int RAW_ERR_NO_SPACE = -3;
+  public static final int RAW_ERR_ARG = -4;
+  public static final int RAW_ERR_CORRUPT = -5;
+
+  public static final int PLACEMENT_FIRST_FIT = 0;
+  public static final int PLACEMENT_NEXT_FIT = 1;
+  public static final int PLACEMENT_ROUND_ROBIN = 2;
+  public static final int PLACEMENT_LOCALITY = 3;
+
+  public static final int POLL_INTERRUPT = 0;
+  public static final int POLL_HYBRID = 1;
+  public static final int POLL_FULL = 2;
+
+  public static final int DURABILITY_NONE = 0;
+  public static final int DURABILITY_FUA = 1;
+  public static final int DURABILITY_GROUP = 2;
+
+  // A stats() snapshot is a rawstat_snapshot of this many longs, see rawstat.h.
+  public static final int SNAPSHOT_LONGS = 134;
+
+  // scan() hands its callback arrays of scan_record
+  // {long division; char* payload; int size;}.
+  public static final long SCAN_RECORD_BYTES = 24;
+
+  // Return false to stop the scan. Payloads are valid only during the call,
+  // and the callback must not throw - it runs as a native upcall.
+  @FunctionalInterface
+  public interface ScanCallback {
+    boolean accept(MemorySegment records, int count);
+  }
+
+  private static final Linker LINKER = Linker.nativeLinker();
+  private static final SymbolLookup LIB = SymbolLookup.libraryLookup(
+      System.getProperty("raw.library", System.mapLibraryName("raw")), Arena.global());
+
+  private static final MethodHandle CONFIG = bind("configJNA",
+      FunctionDescriptor.of(JAVA_BOOLEAN, ADDRESS, JAVA_INT, JAVA_INT));
+  private static final MethodHandle READ_INTO = bind("readIntoJNA",
+      FunctionDescriptor.of(JAVA_INT, JAVA_LONG, ADDRESS, JAVA_INT));
+  private static final MethodHandle WRITE = bind("writeJNA",
+      FunctionDescriptor.of(JAVA_BOOLEAN, JAVA_LONG, ADDRESS, JAVA_INT));
+  private static final MethodHandle GET_AVAILABLE = bind("getAvailableSubsectorJNA",
+      FunctionDescriptor.ofVoid(JAVA_LONG, ADDRESS));
+  private static final MethodHandle ERASE = bind("eraseSubsectorJNA",
+      FunctionDescriptor.ofVoid(JAVA_LONG));
+  private static final MethodHandle SET_COMPRESSED_REF_TAB = bind("setCompressedRefTabJNA",
+      FunctionDescriptor.ofVoid(JAVA_BOOLEAN));
+  private static final MethodHandle SET_PLACEMENT_POLICY = bind("setPlacementPolicyJNA",
+      FunctionDescriptor.of(JAVA_BOOLEAN, JAVA_INT));
+  private static final MethodHandle CONFIG_SIZE_CLASSES = bind("configSizeClassesJNA",
+      FunctionDescriptor.of(JAVA_BOOLEAN, ADDRESS));
+  private static final MethodHandle ALLOC_RECORD = bind("allocRecordJNA",
+      FunctionDescriptor.of(JAVA_LONG, JAVA_INT));
+  private static final MethodHandle WRITE_RECORD = bind("writeRecordJNA",
+      FunctionDescriptor.of(JAVA_INT, JAVA_LONG, ADDRESS, JAVA_INT));
+  private static final MethodHandle READ_RECORD = bind("readRecordJNA",
+      FunctionDescriptor.of(JAVA_INT, JAVA_LONG, ADDRESS, JAVA_INT));
+  private static final MethodHandle FREE_RECORD = bind("freeRecordJNA",
+      FunctionDescriptor.ofVoid(JAVA_LONG));
+  private static final MethodHandle SET_COMPRESSION = bind("setCompressionJNA",
+      FunctionDescriptor.of(JAVA_BOOLEAN, JAVA_BOOLEAN, ADDRESS, JAVA_INT));
+  private static final MethodHandle PUT_RECORD = bind("putRecordJNA",
+      FunctionDescriptor.of(JAVA_LONG, ADDRESS, JAVA_INT));
+  private static final MethodHandle GET_RECORD = bind("getRecordJNA",
+      FunctionDescriptor.of(JAVA_INT, JAVA_LONG, ADDRESS, JAVA_INT));
+  private static final MethodHandle SET_WRITE_BATCHING = bind("setWriteBatchingJNA",
+      FunctionDescriptor.of(JAVA_BOOLEAN, JAVA_INT, JAVA_INT));
+  private static final MethodHandle READ_BATCH = bind("readBatchJNA",
+      FunctionDescriptor.of(JAVA_INT, ADDRESS, JAVA_INT, JAVA_INT, ADDRESS));
+  private static final MethodHandle FLUSH = bind("flushJNA",
+      FunctionDescriptor.of(JAVA_BOOLEAN));
+  private static final MethodHandle SCAN = bind("scanJNA",
+      FunctionDescriptor.of(JAVA_LONG, ADDRESS, ADDRESS, JAVA_INT));
+  private static final MethodHandle STATS = bind("statsJNA",
+      FunctionDescriptor.of(JAVA_BOOLEAN, ADDRESS));
+  private static final MethodHandle SET_QOS = bind("setQosJNA",
+      FunctionDescriptor.of(JAVA_BOOLEAN, JAVA_INT, JAVA_INT, JAVA_INT, JAVA_INT));
+  private static final MethodHandle SET_WRITE_LIMITS = bind("setWriteLimitsJNA",
+      FunctionDescriptor.ofVoid(JAVA_LONG, JAVA_LONG));
+  private static final MethodHandle SET_CHECKSUMS = bind("setChecksumsJNA",
+      FunctionDescriptor.ofVoid(JAVA_BOOLEAN));
+  private static final MethodHandle SET_POLL_MODE = bind("setPollModeJNA",
+      FunctionDescriptor.of(JAVA_BOOLEAN, JAVA_INT, JAVA_INT));
+  private static final MethodHandle SET_DURABILITY = bind("setDurabilityJNA",
+      FunctionDescriptor.of(JAVA_BOOLEAN, JAVA_INT, JAVA_INT));
+  private static final MethodHandle SYNC = bind("syncJNA",
+      FunctionDescriptor.of(JAVA_BOOLEAN));
+  private static final MethodHandle SET_READ_AHEAD = bind("setReadAheadJNA",
+      FunctionDescriptor.of(JAVA_BOOLEAN, JAVA_INT));
+
+  private static final FunctionDescriptor SCAN_CALLBACK =
+      FunctionDescriptor.of(JAVA_BOOLEAN, ADDRESS, JAVA_INT, ADDRESS);
+  private static final MethodHandle SCAN_ACCEPT;
+
+  static {
+    try {
+      SCAN_ACCEPT = MethodHandles.lookup().findStatic(RawFFM.class, "scanAccept",
+          MethodType.methodType(boolean.class, ScanCallback.class, MemorySegment.class, int.class,
+              MemorySegment.class));
+    } catch (ReflectiveOperationException e) {
+      throw new ExceptionInInitializerError(e);
+    }
+  }
+
+  private RawFFM() {}
+
+  private static MethodHandle bind(String name, FunctionDescriptor descriptor) {
+    MemorySegment symbol = LIB.find(name)
+        .orElseThrow(() -> new UnsatisfiedLinkError("raw library has no " + name));
+
+    return LINKER.downcallHandle(symbol, descriptor);
+  }
+
+  private static RuntimeException rethrow(Throwable t) {
+    if (t instanceof RuntimeException e) {
+      return e;
+    }
+    if (t instanceof Error e) {
+      throw e;
+    }
+    return new IllegalStateException(t);
+  }
+
+  // Sub-sector API
+
+  public static boolean config(String deviceName, int size, int numOfSubSector) {
+    try (Arena arena = Arena.ofConfined()) {
+      return (boolean) CONFIG.invokeExact(arena.allocateFrom(deviceName), size, numOfSubSector);
+    } catch (Throwable t) {
+      throw rethrow(t);
+    }
+  }
+
+  // Bytes copied into dest, or a RAW_ERR_* status.
+  public static int readInto(long division, MemorySegment dest, int readSize) {
+    try {
+      return (int) READ_INTO.invokeExact(division, dest, readSize);
+    } catch (Throwable t) {
+      throw rethrow(t);
+    }
+  }
+
+  public static boolean write(long division, MemorySegment message, int writeSize) {
+    try {
+      return (boolean) WRITE.invokeExact(division, message, writeSize);
+    } catch (Throwable t) {
+      throw rethrow(t);
+    }
+  }
+
+  // positions holds one C long per sub-sector wanted.
+  public static void getAvailableSubsector(long size, MemorySegment positions) {
+    try {
+      GET_AVAILABLE.invokeExact(size, positions);
+    } catch (Throwable t) {
+      throw rethrow(t);
+    }
+  }
+
+  public static void erase(long division) {
+    try {
+      ERASE.invokeExact(division);
+    } catch (Throwable t) {
+      throw rethrow(t);
+    }
+  }
+
+  // Bitmap layout; call before config() or configSizeClasses().
+  public static void setCompressedRefTab(boolean compressed) {
+    try {
+      SET_COMPRESSED_REF_TAB.invokeExact(compressed);
+    } catch (Throwable t) {
+      throw rethrow(t);
+    }
+  }
+
+  // One of the PLACEMENT_* policies.
+  public static boolean setPlacementPolicy(int policy) {
+    try {
+      return (boolean) SET_PLACEMENT_POLICY.invokeExact(policy);
+    } catch (Throwable t) {
+      throw rethrow(t);
+    }
+  }
+
+  // Size class records
+
+  public static boolean configSizeClasses(String deviceName) {
+    try (Arena arena = Arena.ofConfined()) {
+      return (boolean) CONFIG_SIZE_CLASSES.invokeExact(arena.allocateFrom(deviceName));
+    } catch (Throwable t) {
+      throw rethrow(t);
+    }
+  }
+
+  // Record handle, or a RAW_ERR_* status.
+  public static long allocRecord(int size) {
+    try {
+      return (long) ALLOC_RECORD.invokeExact(size);
+    } catch (Throwable t) {
+      throw rethrow(t);
+    }
+  }
+
+  public static int writeRecord(long record, MemorySegment message, int writeSize) {
+    try {
+      return (int) WRITE_RECORD.invokeExact(record, message, writeSize);
+    } catch (Throwable t) {
+      throw rethrow(t);
+    }
+  }
+
+  // Returns min(readSize, slot size), not the written length - the slot is
+  // zero padded. putRecord/getRecord keep the length.
+  public static int readRecord(long record, MemorySegment dest, int readSize) {
+    try {
+      return (int) READ_RECORD.invokeExact(record, dest, readSize);
+    } catch (Throwable t) {
+      throw rethrow(t);
+    }
+  }
+
+  public static void freeRecord(long record) {
+    try {
+      FREE_RECORD.invokeExact(record);
+    } catch (Throwable t) {
+      throw rethrow(t);
+    }
+  }
+
+  // LZ4 for putRecord records; dict (MemorySegment.NULL for none) holds sample records.
+  public static boolean setCompression(boolean enabled, MemorySegment dict, int dictSize) {
+    try {
+      return (boolean) SET_COMPRESSION.invokeExact(enabled, dict, dictSize);
+    } catch (Throwable t) {
+      throw rethrow(t);
+    }
+  }
+
+  // Record handle, or a RAW_ERR_* status.
+  public static long putRecord(MemorySegment message, int size) {
+    try {
+      return (long) PUT_RECORD.invokeExact(message, size);
+    } catch (Throwable t) {
+      throw rethrow(t);
+    }
+  }
+
+  // Bytes copied into dest, or a RAW_ERR_* status.
+  public static int getRecord(long record, MemorySegment dest, int destSize) {
+    try {
+      return (int) GET_RECORD.invokeExact(record, dest, destSize);
+    } catch (Throwable t) {
+      throw rethrow(t);
+    }
+  }
+
+  // Write batching and merged reads
+
+  // maxPending 0 writes through again; deadlineUs 0 runs no flusher, so the
+  // queue goes out when full or on flush()/sync().
+  public static boolean setWriteBatching(int maxPending, int deadlineUs) {
+    try {
+      return (boolean) SET_WRITE_BATCHING.invokeExact(maxPending, deadlineUs);
+    } catch (Throwable t) {
+      throw rethrow(t);
+    }
+  }
+
+  // divisions holds count longs; dest receives count * readSize bytes.
+  public static int readBatch(MemorySegment divisions, int count, int readSize, MemorySegment dest) {
+    try {
+      return (int) READ_BATCH.invokeExact(divisions, count, readSize, dest);
+    } catch (Throwable t) {
+      throw rethrow(t);
+    }
+  }
+
+  // Writes out batched sectors; false also if an earlier flush failed since
+  // the last flush() or sync().
+  public static boolean flush() {
+    try {
+      return (boolean) FLUSH.invokeExact();
+    } catch (Throwable t) {
+      throw rethrow(t);
+    }
+  }
+
+  // Scan, metrics and scheduling
+
+  // Streams every occupied sub-sector to callback in arrays of up to
+  // batchSize records. Returns the records delivered, or a RAW_ERR_* status.
+  public static long scan(ScanCallback callback, int batchSize) {
+    try (Arena arena = Arena.ofConfined()) {
+      MemorySegment stub = LINKER.upcallStub(SCAN_ACCEPT.bindTo(callback), SCAN_CALLBACK, arena);
+      return (long) SCAN.invokeExact(stub, MemorySegment.NULL, batchSize);
+    } catch (Throwable t) {
+      throw rethrow(t);
+    }
+  }
+
+  private static boolean scanAccept(ScanCallback callback, MemorySegment records, int count,
+      MemorySegment udata) {
+    return callback.accept(records.reinterpret(count * SCAN_RECORD_BYTES), count);
+  }
+
+  public static long scanDivision(MemorySegment records, int index) {
+    return records.get(JAVA_LONG, index * SCAN_RECORD_BYTES);
+  }
+
+  public static MemorySegment scanPayload(MemorySegment records, int index) {
+    int size = records.get(JAVA_INT, index * SCAN_RECORD_BYTES + 16);
+    return records.get(ADDRESS, index * SCAN_RECORD_BYTES + 8).reinterpret(size);
+  }
+
+  // snapshot holds SNAPSHOT_LONGS longs.
+  public static boolean stats(MemorySegment snapshot) {
+    try {
+      return (boolean) STATS.invokeExact(snapshot);
+    } catch (Throwable t) {
+      throw rethrow(t);
+    }
+  }
+
+  // depth 0 turns the scheduler off; the weights share its slots.
+  public static boolean setQos(int depth, int readWeight, int writeWeight, int backgroundWeight) {
+    try {
+      return (boolean) SET_QOS.invokeExact(depth, readWeight, writeWeight, backgroundWeight);
+    } catch (Throwable t) {
+      throw rethrow(t);
+    }
+  }
+
+  // 0 - unlimited. Applies with or without setQos().
+  public static void setWriteLimits(long bytesPerSec, long iops) {
+    try {
+      SET_WRITE_LIMITS.invokeExact(bytesPerSec, iops);
+    } catch (Throwable t) {
+      throw rethrow(t);
+    }
+  }
+
+  // Length + CRC32C header in every sub-sector; corrupt reads return RAW_ERR_CORRUPT.
+  public static void setChecksums(boolean enabled) {
+    try {
+      SET_CHECKSUMS.invokeExact(enabled);
+    } catch (Throwable t) {
+      throw rethrow(t);
+    }
+  }
+
+  // How single-sector I/O waits: POLL_INTERRUPT, POLL_HYBRID or POLL_FULL,
+  // spinning at most cpuBudgetPct of a core per thread.
+  public static boolean setPollMode(int mode, int cpuBudgetPct) {
+    try {
+      return (boolean) SET_POLL_MODE.invokeExact(mode, cpuBudgetPct);
+    } catch (Throwable t) {
+      throw rethrow(t);
+    }
+  }
+
+  // DURABILITY_NONE, DURABILITY_FUA or DURABILITY_GROUP. In the last two,
+  // writes return true only once durable - batched ones wait for their flush.
+  public static boolean setDurability(int mode, int groupWindowUs) {
+    try {
+      return (boolean) SET_DURABILITY.invokeExact(mode, groupWindowUs);
+    } catch (Throwable t) {
+      throw rethrow(t);
+    }
+  }
+
+  // Flush batched writes and the drive cache; true once all writes are durable.
+  public static boolean sync() {
+    try {
+      return (boolean) SYNC.invokeExact();
+    } catch (Throwable t) {
+      throw rethrow(t);
+    }
+  }
+
+  // Prefetch sequential and strided read streams into a pool of maxSectors
+  // sectors (0 - off). Call while no reads are running.
+  public static boolean setReadAhead(int maxSectors) {
+    try {
+      return (boolean) SET_READ_AHEAD.invokeExact(maxSectors);
+    } catch (Throwable t) {
+      throw rethrow(t);
+    }
+  }
+}
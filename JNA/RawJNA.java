@@ -1,7 +1,65 @@
+import com.sun.jna.Callback;
 import com.sun.jna.Library;
- 
+import com.sun.jna.Pointer;
+
+/*
+ * JNA mapping of the raw.c exports: uint64_t -> long, uint32_t -> int, C long -> long.
+ * C bool results are returned as byte (non-zero is true); JNA's boolean is a
+ * 4-byte int and would read past the byte the C side sets.
+ */
 public interface RawJNA extends Library {
-  public int main(int argc, String[] argv);
-  public String readJNA(String device_name, int size, long offset);
-  public boolean writeJNA(String device_name, String message, long offset);
+  // Status codes of the int returning calls.
+  int RAW_OK = 0;
+  int RAW_ERR_IO = -1;
+  int RAW_ERR_NOT_FOUND = -2;
+  int RAW_ERR_NO_SPACE = -3;
+  int RAW_ERR_ARG = -4;
+  int RAW_ERR_CORRUPT = -5;
+
+  // Sub-sector API
+  public byte configJNA(String device_name, int size, int num_of_sub_sector);
+  public String readJNA(long division, int read_size);
+  public int readIntoJNA(long division, byte[] dest, int read_size);
+  public byte writeJNA(long division, String message, int write_size);
+  public void getAvailableSubsectorJNA(long size, long[] positions);
+  public void eraseSubsectorJNA(long division);
+  public void setCompressedRefTabJNA(byte compressed);
+  public byte setPlacementPolicyJNA(int policy);
+
+  // Size class records
+  public byte configSizeClassesJNA(String device_name);
+  public long allocRecordJNA(int size);
+  public int writeRecordJNA(long record, byte[] message, int write_size);
+  // Returns min(read_size, slot size), not the written length - the slot is
+  // zero padded. putRecordJNA/getRecordJNA keep the length.
+  public int readRecordJNA(long record, byte[] dest, int read_size);
+  public void freeRecordJNA(long record);
+  public byte setCompressionJNA(byte enabled, byte[] dict, int dict_size);
+  public long putRecordJNA(byte[] message, int size);
+  public int getRecordJNA(long record, byte[] dest, int dest_size);
+
+  // Write batching and merged reads
+  // deadline_us 0: no flusher, the queue goes out when full or on flushJNA/syncJNA.
+  // flushJNA/syncJNA also return false if a flush failed since they last reported.
+  public byte setWriteBatchingJNA(int max_pending, int deadline_us);
+  public byte flushJNA();
+  public int readBatchJNA(long[] divisions, int count, int read_size, byte[] dest);
+
+  // records points at count scan_record {long division; char* payload; int size;} of 24 bytes.
+  public interface ScanCallback extends Callback {
+    byte invoke(Pointer records, int count, Pointer udata);
+  }
+  public long scanJNA(ScanCallback callback, Pointer udata, int batch_size);
+
+  // snapshot is a rawstat_snapshot, see rawstat.h (134 longs).
+  public byte statsJNA(long[] snapshot);
+  public byte setQosJNA(int depth, int read_weight, int write_weight, int background_weight);
+  public void setWriteLimitsJNA(long bytes_per_sec, long iops);
+  public void setChecksumsJNA(byte enabled);
+  // mode: 0 - interrupts, 1 - hybrid polling, 2 - full polling.
+  public byte setPollModeJNA(int mode, int cpu_budget_pct);
+  // mode: 0 - none, 1 - FUA per write, 2 - group commit.
+  public byte setDurabilityJNA(int mode, int group_window_us);
+  public byte syncJNA();
+  public byte setReadAheadJNA(int max_sectors);
 }
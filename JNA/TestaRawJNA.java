@@ -2,20 +2,22 @@ import com.sun.jna.Native;
  
 public class TestaRawJNA {
  
+  // Usage: java TestaRawJNA device record_size sub_sectors division message
   public static void main(String[] args) {
     RawJNA rawObj = (RawJNA)
       Native.loadLibrary("raw", RawJNA.class);
- 
-    /*String str = rawObj.readJNA(args[0], Integer.parseInt(args[1]), Long.parseLong(args[2]));
-    System.out.println("A String retornada foi: " + str);
 
-    if (Integer.parseInt(args[4]) >= 2 ){
-      rawObj.writeJNA(args[0], args[3], Long.parseLong(args[2]));
-      String str = rawObj.readJNA(args[0], Integer.parseInt(args[1]), Long.parseLong(args[2]));
-      System.out.println("A String retornada foi: " + str);
-    }*/
+    if (rawObj.configJNA(args[0], Integer.parseInt(args[1]), Integer.parseInt(args[2])) == 0) {
+      System.out.println("Erro na configuração do dispositivo.");
+      return;
+    }
+
+    long division = Long.parseLong(args[3]);
 
-    int resultado = rawObj.main(args.length, args);
-    System.out.println("O resultado é: " + resultado);
+    rawObj.eraseSubsectorJNA(division);
+    rawObj.writeJNA(division, args[4], args[4].length() + 1);
+
+    String str = rawObj.readJNA(division, args[4].length() + 1);
+    System.out.println("A String retornada foi: " + str);
   }
 }
@@ -0,0 +1,156 @@
+#!/usr/bin/env python3
+"""
+S1Search Research
+Raw Device Access: benchmark regression gate
+
+Usage: bench/benchcmp.py -b BASELINE.json [...] -c CANDIDATE.json [...]
+Compares devbench/microbench results against a stored baseline. Samples of
+the same benchmark and metric are pooled over all files given on each side,
+so several runs can be combined. A metric regresses when the Welch
+confidence interval of its change lies entirely on the worse side of zero
+and the mean change is beyond the threshold. Exits 1 on any regression.
+"""
+
+import argparse
+import json
+import math
+import statistics
+import sys
+
+HIGHER_IS_BETTER = ("iops", "bandwidth_mbps")
+TAIL_METRICS = ("p99_us", "p999_us")
+
+
+def load_samples(paths):
+    """Return {(benchmark, metric): [samples]} pooled over all files."""
+    pooled = {}
+
+    for path in paths:
+        with open(path) as f:
+            doc = json.load(f)
+
+        for bench in doc.get("benchmarks", []):
+            if "metrics" in bench:
+                metrics = {name: m["samples"] for name, m in bench["metrics"].items()}
+            else:
+                metrics = {"ns_per_op": bench["samples"]}  # microbench
+
+            for name, samples in metrics.items():
+                pooled.setdefault((bench["name"], name), []).extend(samples)
+
+    return pooled
+
+
+def t_quantile(p, df):
+    """Student t quantile - exact for df 1 and 2, Cornish-Fisher beyond."""
+    if df <= 1:
+        return math.tan(math.pi * (p - 0.5))
+    if df <= 2:
+        return (2 * p - 1) / math.sqrt(2 * p * (1 - p))
+
+    z = statistics.NormalDist().inv_cdf(p)
+    return (z + (z ** 3 + z) / (4 * df)
+            + (5 * z ** 5 + 16 * z ** 3 + 3 * z) / (96 * df ** 2)
+            + (3 * z ** 7 + 19 * z ** 5 + 17 * z ** 3 - 15 * z) / (384 * df ** 3))
+
+
+def welch_interval(base, cand, confidence):
+    """Confidence interval of mean(cand) - mean(base), or None without enough samples."""
+    if len(base) < 2 or len(cand) < 2:
+        return None
+
+    vb = statistics.variance(base) / len(base)
+    vc = statistics.variance(cand) / len(cand)
+    diff = statistics.fmean(cand) - statistics.fmean(base)
+
+    if vb + vc == 0:
+        return (diff, diff)
+
+    df = (vb + vc) ** 2 / (vb ** 2 / (len(base) - 1) + vc ** 2 / (len(cand) - 1))
+    half = t_quantile(1 - (1 - confidence) / 2, df) * math.sqrt(vb + vc)
+    return (diff - half, diff + half)
+
+
+def compare(key, base, cand, args):
+    """Return one report row for a benchmark metric."""
+    metric = key[1]
+    mean_b, mean_c = statistics.fmean(base), statistics.fmean(cand)
+    threshold = (args.tail_threshold if metric in TAIL_METRICS else args.threshold) / 100
+    worse = -1 if metric in HIGHER_IS_BETTER else 1  # sign of a change for the worse
+
+    change = (mean_c - mean_b) / mean_b if mean_b else 0.0
+    interval = welch_interval(base, cand, args.confidence)
+
+    if interval is None:
+        # Not enough runs for an interval - fall back to the threshold alone.
+        significant_worse = significant_better = True
+        rel = None
+    else:
+        rel = tuple(x / mean_b if mean_b else 0.0 for x in interval)
+        significant_worse = min(r * worse for r in rel) > 0
+        significant_better = max(r * worse for r in rel) < 0
+
+    if significant_worse and change * worse > threshold:
+        verdict = "REGRESSED"
+    elif significant_better and -change * worse > threshold:
+        verdict = "improved"
+    elif interval is not None and (significant_worse or significant_better):
+        verdict = "ok (below threshold)"
+    else:
+        verdict = "ok" if interval is not None else "ok (no CI)"
+
+    return {
+        "bench": key[0], "metric": metric, "base": mean_b, "cand": mean_c,
+        "change": change, "rel": rel, "verdict": verdict,
+    }
+
+
+def print_report(rows, missing, confidence):
+    header = "%-26s %-15s %14s %14s %9s %21s  %s" % (
+        "benchmark", "metric", "baseline", "candidate", "change",
+        "%d%% CI" % round(confidence * 100), "verdict")
+    print(header)
+    print("-" * len(header))
+
+    for r in rows:
+        ci = "n/a" if r["rel"] is None else "[%+7.2f%%, %+7.2f%%]" % (r["rel"][0] * 100, r["rel"][1] * 100)
+        print("%-26s %-15s %14.3f %14.3f %+8.2f%% %21s  %s" % (
+            r["bench"], r["metric"], r["base"], r["cand"], r["change"] * 100, ci, r["verdict"]))
+
+    for bench, metric in missing:
+        print("%-26s %-15s %14s %14s %9s %21s  %s" % (bench, metric, "", "", "", "", "missing in candidate"))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compare benchmark JSON against a baseline.")
+    parser.add_argument("-b", "--baseline", nargs="+", required=True, help="baseline result files")
+    parser.add_argument("-c", "--candidate", nargs="+", required=True, help="candidate result files")
+    parser.add_argument("--threshold", type=float, default=5.0,
+                        help="minimum %% change in IOPS, bandwidth, p50 and ns/op to flag (default 5)")
+    parser.add_argument("--tail-threshold", type=float, default=10.0,
+                        help="minimum %% change in p99/p99.9 latency to flag (default 10)")
+    parser.add_argument("--confidence", type=float, default=0.95,
+                        help="confidence level of the intervals (default 0.95)")
+    args = parser.parse_args()
+
+    if not 0 < args.confidence < 1:
+        parser.error("confidence must be between 0 and 1")
+
+    base = load_samples(args.baseline)
+    cand = load_samples(args.candidate)
+
+    rows = [compare(key, base[key], cand[key], args)
+            for key in base if key in cand and base[key] and cand[key]]
+    missing = [key for key in base if key not in cand]
+
+    print_report(rows, missing, args.confidence)
+
+    regressed = [r for r in rows if r["verdict"] == "REGRESSED"]
+    print("\n%d metrics compared, %d regressed, %d improved" % (
+        len(rows), len(regressed), sum(r["verdict"] == "improved" for r in rows)))
+
+    return 1 if regressed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,63 @@
+/*
+	S1Search Research 
+	Raw Device Access: timer overhead and drift benchmark
+
+	Usage: ./bench/clock_bench [calls] [drift(seconds)]
+	Compares the cost of each clock.h timer and how far the calibrated TSC
+	clock wanders from CLOCK_MONOTONIC.
+*/
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../clock.h"
+
+//======================================================================================================
+// Helpers
+//
+
+//------------------------------------------------
+// Average cost of one call to a timer.
+//
+#define TIME_CALLS(label, expr, calls) do { \
+	uint64_t i, sink = 0, start_ns = cf_getns(); \
+	for (i = 0; i < (calls); i++) { \
+		sink += (expr); \
+	} \
+	uint64_t total_ns = cf_getns() - start_ns; \
+	__asm__ volatile("" : : "r"(sink)); \
+	printf(" - %-22s %8.2f ns/call\n", label, (double)total_ns / (calls)); \
+} while (0)
+
+//======================================================================================================
+// Main
+//
+int main(int argc, char* argv[]) {
+	uint64_t calls = argc > 1 ? strtoull(argv[1], NULL, 10) : 10000000;
+	uint32_t drift_s = argc > 2 ? (uint32_t)atoi(argv[2]) : 2;
+
+	printf("=> clock benchmark: %" PRIu64 " calls per timer\n", calls);
+	printf("-> invariant TSC: %s\n", cf_ticks_init() ? "yes" : "no (ticks are ns)");
+
+	printf("\n-> overhead\n");
+	TIME_CALLS("cf_getms", cf_getms(), calls);
+	TIME_CALLS("cf_getus", cf_getus(), calls);
+	TIME_CALLS("cf_getns", cf_getns(), calls);
+	TIME_CALLS("cf_ticks", cf_ticks(), calls);
+	TIME_CALLS("cf_ticks_serial", cf_ticks_serial(), calls);
+	TIME_CALLS("cf_ticks_to_ns(ticks)", cf_ticks_to_ns(cf_ticks()), calls);
+
+	printf("\n-> drift over %" PRIu32 " s\n", drift_s);
+	uint64_t start_ns = cf_getns(), start_ticks = cf_ticks_serial();
+	sleep(drift_s);
+	uint64_t mono_ns = cf_getns() - start_ns;
+	uint64_t tsc_ns = cf_ticks_to_ns(cf_ticks_serial() - start_ticks);
+	int64_t delta_ns = (int64_t)tsc_ns - (int64_t)mono_ns;
+
+	printf(" - monotonic %" PRIu64 " ns, ticks %" PRIu64 " ns, delta %" PRId64 " ns (%.2f ppm)\n",
+			mono_ns, tsc_ns, delta_ns, (double)delta_ns * 1000000.0 / mono_ns);
+
+	return 0;
+}
@@ -0,0 +1,415 @@
+/*
+	S1Search Research 
+	Raw Device Access: device throughput and tail latency benchmark
+
+	Usage: ./bench/devbench device [seconds] [repetitions] [threads] [read_pct] [record_bytes] [columns] [span_mb] [poll] [durability]
+	Runs random read, random write, mixed and sequential read (without and
+	with read-ahead) phases through readJNA/writeJNA against a device or
+	preallocated file, repeating each phase so results carry their own
+	noise. Reports IOPS, payload bandwidth, p50/p99/p99.9 latency and
+	process CPU use as JSON on stdout, for bench/benchcmp.py.
+	poll - interrupt, hybrid, full or all: also run a single-thread random
+	read phase (QD1) in that polling mode, or in each of them. - for none.
+	durability - none, fua or group[:window_us] for every write.
+	WARNING: overwrites the first span_mb of the device.
+*/
+
+#include "../raw.c"
+
+//======================================================================================================
+// Constants
+//
+#define LAT_SAMPLES_PER_THREAD (1 << 18) // reservoir per thread per repetition
+#define MAX_THREADS 64
+#define MAX_REPETITIONS 100
+#define MAX_PHASES 8
+#define READAHEAD_SECTORS 1024 // pool of the read-ahead phase
+
+//======================================================================================================
+// Typedefs
+//
+typedef struct _bench_thread {
+	pthread_t thread;
+	uint32_t index;
+	uint32_t read_pct;
+	bool sequential;
+	uint64_t cursor; // next division of a sequential reader, in its own region
+	uint64_t rand;
+	uint64_t ops;
+	uint64_t num_samples;
+	uint32_t* samples;
+} bench_thread;
+
+typedef struct _phase_result {
+	double iops[MAX_REPETITIONS];
+	double bandwidth_mbps[MAX_REPETITIONS];
+	double p50_us[MAX_REPETITIONS];
+	double p99_us[MAX_REPETITIONS];
+	double p999_us[MAX_REPETITIONS];
+	double cpu_pct[MAX_REPETITIONS]; // of one core
+} phase_result;
+
+typedef struct _phase {
+	const char* name;
+	uint32_t read_pct;
+	uint32_t threads;
+	uint32_t poll_mode;
+	bool sequential;
+	uint32_t readahead_sectors; // 0 - read-ahead off
+} phase;
+
+//======================================================================================================
+// Globals
+//
+static FILE* g_json; // stdout; the library's own prints are sent to stderr
+static volatile bool g_stop;
+static uint32_t g_num_threads = 1;
+static uint64_t g_num_sectors;
+static uint32_t g_sub_sector_bytes;
+static bench_thread g_threads[MAX_THREADS];
+static const char* POLL_NAMES[] = { "interrupt", "hybrid", "full" };
+
+//======================================================================================================
+// Helpers
+//
+
+//------------------------------------------------
+// Per-thread xorshift generator.
+//
+static inline uint64_t next_rand(bench_thread* bt) {
+	bt->rand ^= bt->rand << 13;
+	bt->rand ^= bt->rand >> 7;
+	bt->rand ^= bt->rand << 17;
+	return bt->rand;
+}
+
+//------------------------------------------------
+// Random division in one of this thread's sectors. Threads never share a
+// sector, so concurrent read-modify-writes don't lose each other's updates.
+//
+static uint64_t next_division(bench_thread* bt) {
+	uint64_t sectors_per_thread = g_num_sectors / g_num_threads;
+	uint64_t sector = (next_rand(bt) % sectors_per_thread) * g_num_threads + bt->index;
+	uint64_t offset_index = sector * (g_device->read_bytes / g_device->min_op_bytes);
+
+	return offset_index * g_ref_tab_columns + next_rand(bt) % g_ref_tab_columns;
+}
+
+//------------------------------------------------
+// Next division of a sequential reader: every sub_sector of a sector, then
+// the next sector, wrapping around in this thread's share of the span.
+//
+static uint64_t next_division_sequential(bench_thread* bt) {
+	uint64_t sectors_per_thread = g_num_sectors / g_num_threads;
+	uint64_t sector = bt->index * sectors_per_thread + (bt->cursor / g_ref_tab_columns) % sectors_per_thread;
+	uint64_t offset_index = sector * (g_device->read_bytes / g_device->min_op_bytes);
+
+	return offset_index * g_ref_tab_columns + bt->cursor++ % g_ref_tab_columns;
+}
+
+//------------------------------------------------
+// Keep a uniform sample of latencies once the reservoir is full.
+//
+static inline void record_latency(bench_thread* bt, uint32_t ns) {
+	if (bt->num_samples < LAT_SAMPLES_PER_THREAD) {
+		bt->samples[bt->num_samples] = ns;
+	}
+	else {
+		uint64_t slot = next_rand(bt) % (bt->num_samples + 1);
+		if (slot < LAT_SAMPLES_PER_THREAD) {
+			bt->samples[slot] = ns;
+		}
+	}
+	bt->num_samples++;
+}
+
+//------------------------------------------------
+// Order latencies ascending.
+//
+static int compare_uint32(const void* a, const void* b) {
+	uint32_t ua = *(const uint32_t*)a, ub = *(const uint32_t*)b;
+	return ua < ub ? -1 : ua > ub;
+}
+
+//------------------------------------------------
+// CPU time used by the whole process, in ns.
+//
+static uint64_t process_cpu_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//------------------------------------------------
+// Write the span once and reference every division in it, so reads hit.
+//
+static bool prefill(uint64_t span_bytes) {
+	uint8_t* p_buffer = cf_valloc(g_large_block_ops_bytes);
+	uint64_t offset, bit, num_bits;
+
+	if (! p_buffer) {
+		return false;
+	}
+	memset(p_buffer, 'r', g_large_block_ops_bytes);
+
+	for (offset = 0; offset < span_bytes; offset += g_large_block_ops_bytes) {
+		if (! write_to_device(g_device, offset, g_large_block_ops_bytes, p_buffer)) {
+			free(p_buffer);
+			return false;
+		}
+	}
+	free(p_buffer);
+
+	num_bits = (span_bytes / g_device->min_op_bytes) * g_ref_tab_columns;
+	for (bit = 0; bit < num_bits; bit++) {
+		add_sector_ref(bit / g_ref_tab_columns, bit % g_ref_tab_columns);
+	}
+
+	return true;
+}
+
+//======================================================================================================
+// Threads
+//
+
+//------------------------------------------------
+// Issue random reads and writes until told to stop.
+//
+static void* bench_op(void* arg) {
+	bench_thread* bt = (bench_thread*)arg;
+	char* message = malloc(g_sub_sector_bytes);
+
+	memset(message, 'w', g_sub_sector_bytes);
+	message[g_sub_sector_bytes - 1] = '\0';
+
+	while (! g_stop) {
+		uint64_t division = bt->sequential ? next_division_sequential(bt) : next_division(bt);
+		uint64_t start_ticks = cf_ticks();
+
+		if (next_rand(bt) % 100 < bt->read_pct) {
+			readJNA(division, g_sub_sector_bytes);
+		}
+		else {
+			eraseSubsectorJNA(division);
+			writeJNA(division, message, g_sub_sector_bytes);
+		}
+
+		uint64_t ns = cf_ticks_to_ns(cf_ticks() - start_ticks);
+		record_latency(bt, ns > UINT32_MAX ? UINT32_MAX : (uint32_t)ns);
+		bt->ops++;
+	}
+
+	free(message);
+	return NULL;
+}
+
+//======================================================================================================
+// Phases
+//
+
+//------------------------------------------------
+// Run one repetition of a phase and fill in its row of results.
+//
+static bool run_phase(const phase* ph, uint32_t seconds, phase_result* result, uint32_t rep) {
+	static uint32_t latencies[LAT_SAMPLES_PER_THREAD * MAX_THREADS];
+	uint64_t ops = 0, num_latencies = 0, start_ns, start_cpu_ns;
+	uint32_t t;
+
+	g_num_threads = ph->threads;
+	setPollModeJNA(ph->poll_mode, 100);
+	setReadAheadJNA(ph->readahead_sectors);
+
+	g_stop = false;
+	start_ns = cf_getns();
+	start_cpu_ns = process_cpu_ns();
+
+	for (t = 0; t < g_num_threads; t++) {
+		g_threads[t].read_pct = ph->read_pct;
+		g_threads[t].sequential = ph->sequential;
+		g_threads[t].cursor = 0;
+		g_threads[t].ops = 0;
+		g_threads[t].num_samples = 0;
+
+		if (pthread_create(&g_threads[t].thread, NULL, bench_op, &g_threads[t]) != 0) {
+			fprintf(stderr, "=> ERROR: couldn't create bench thread\n");
+			return false;
+		}
+	}
+
+	usleep(seconds * 1000000);
+	g_stop = true;
+
+	for (t = 0; t < g_num_threads; t++) {
+		bench_thread* bt = &g_threads[t];
+		uint64_t kept = bt->num_samples < LAT_SAMPLES_PER_THREAD ? bt->num_samples : LAT_SAMPLES_PER_THREAD;
+
+		pthread_join(bt->thread, NULL);
+		ops += bt->ops;
+		memcpy(&latencies[num_latencies], bt->samples, kept * sizeof(uint32_t));
+		num_latencies += kept;
+	}
+
+	double elapsed_s = (cf_getns() - start_ns) / 1e9;
+	double cpu_s = (process_cpu_ns() - start_cpu_ns) / 1e9;
+
+	qsort(latencies, num_latencies, sizeof(uint32_t), compare_uint32);
+
+	result->iops[rep] = ops / elapsed_s;
+	result->bandwidth_mbps[rep] = ops * (double)g_sub_sector_bytes / elapsed_s / (1024 * 1024);
+	result->p50_us[rep] = num_latencies ? latencies[num_latencies * 50 / 100] / 1e3 : 0;
+	result->p99_us[rep] = num_latencies ? latencies[num_latencies * 99 / 100] / 1e3 : 0;
+	result->p999_us[rep] = num_latencies ? latencies[num_latencies * 999 / 1000] / 1e3 : 0;
+	result->cpu_pct[rep] = cpu_s * 100 / elapsed_s;
+
+	return true;
+}
+
+//------------------------------------------------
+// Print one metric's samples.
+//
+static void print_metric(const char* name, const char* unit, const double* samples,
+		uint32_t repetitions, bool last) {
+	uint32_t r;
+
+	fprintf(g_json, "        \"%s\": {\"unit\": \"%s\", \"samples\": [", name, unit);
+	for (r = 0; r < repetitions; r++) {
+		fprintf(g_json, "%s%.3f", r ? ", " : "", samples[r]);
+	}
+	fprintf(g_json, "]}%s\n", last ? "" : ",");
+}
+
+//======================================================================================================
+// Main
+//
+int main(int argc, char* argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s device [seconds] [repetitions] [threads] [read_pct] "
+				"[record_bytes] [columns] [span_mb] [poll] [durability]\n", argv[0]);
+		return -1;
+	}
+
+	uint32_t seconds = argc > 2 ? atoi(argv[2]) : 5;
+	uint32_t repetitions = argc > 3 ? atoi(argv[3]) : 5;
+	uint32_t read_pct = argc > 5 ? atoi(argv[5]) : 70;
+	uint32_t record_bytes = argc > 6 ? atoi(argv[6]) : 512;
+	uint32_t columns = argc > 7 ? atoi(argv[7]) : 8;
+	uint64_t span_bytes = (argc > 8 ? strtoull(argv[8], NULL, 10) : 64) << 20;
+	const char* poll = argc > 9 && strcmp(argv[9], "-") != 0 ? argv[9] : NULL;
+	const char* durability = argc > 10 ? argv[10] : "none";
+	uint32_t durability_mode, window_us = 0;
+	uint32_t num_threads = argc > 4 ? atoi(argv[4]) : 1;
+	uint32_t t, p, r, num_phases = 0;
+	phase phases[MAX_PHASES];
+
+	if (! seconds || ! repetitions || repetitions > MAX_REPETITIONS || ! num_threads ||
+			num_threads > MAX_THREADS || read_pct > 100 || ! columns) {
+		fprintf(stderr, "=> ERROR: bad arguments\n");
+		return -1;
+	}
+
+	if (strcmp(durability, "none") == 0) {
+		durability_mode = DURABILITY_NONE;
+	}
+	else if (strcmp(durability, "fua") == 0) {
+		durability_mode = DURABILITY_FUA;
+	}
+	else if (strncmp(durability, "group", 5) == 0 && (! durability[5] || durability[5] == ':')) {
+		durability_mode = DURABILITY_GROUP;
+		window_us = durability[5] ? atoi(durability + 6) : 0;
+	}
+	else {
+		fprintf(stderr, "=> ERROR: durability must be none, fua or group[:window_us]\n");
+		return -1;
+	}
+
+	phases[num_phases++] = (phase){ "randread", 100, num_threads, POLL_INTERRUPT, false, 0 };
+	phases[num_phases++] = (phase){ "randwrite", 0, num_threads, POLL_INTERRUPT, false, 0 };
+	phases[num_phases++] = (phase){ "mixed", read_pct, num_threads, POLL_INTERRUPT, false, 0 };
+	phases[num_phases++] = (phase){ "seqread", 100, num_threads, POLL_INTERRUPT, true, 0 };
+	phases[num_phases++] = (phase){ "seqread_ahead", 100, num_threads, POLL_INTERRUPT, true, READAHEAD_SECTORS };
+
+	if (poll) {
+		static char qd1_names[POLL_FULL + 1][32];
+		uint32_t m, matched = 0;
+
+		for (m = POLL_INTERRUPT; m <= POLL_FULL; m++) {
+			if (strcmp(poll, "all") == 0 || strcmp(poll, POLL_NAMES[m]) == 0) {
+				snprintf(qd1_names[m], sizeof(qd1_names[m]), "qd1_read_%s", POLL_NAMES[m]);
+				phases[num_phases++] = (phase){ qd1_names[m], 100, 1, m, false, 0 };
+				matched++;
+			}
+		}
+		if (! matched) {
+			fprintf(stderr, "=> ERROR: poll must be interrupt, hybrid, full or all\n");
+			return -1;
+		}
+	}
+
+	g_json = fdopen(dup(STDOUT_FILENO), "w");
+	dup2(STDERR_FILENO, STDOUT_FILENO);
+
+	if (! configJNA(argv[1], record_bytes, columns)) {
+		return -1;
+	}
+	cf_ticks_init();
+
+	span_bytes -= span_bytes % g_large_block_ops_bytes;
+	if (span_bytes > g_device->num_large_blocks * g_large_block_ops_bytes) {
+		span_bytes = g_device->num_large_blocks * g_large_block_ops_bytes;
+	}
+
+	g_num_sectors = span_bytes / g_device->read_bytes;
+	g_sub_sector_bytes = g_device->read_bytes / columns;
+
+	if (g_num_sectors < num_threads || ! prefill(span_bytes)) {
+		fprintf(stderr, "=> ERROR: couldn't prepare %" PRIu64 " bytes of %s\n", span_bytes, argv[1]);
+		return -1;
+	}
+
+	// Only the measured writes pay for durability, not the prefill.
+	if (! setDurabilityJNA(durability_mode, window_us)) {
+		return -1;
+	}
+
+	for (t = 0; t < num_threads; t++) {
+		g_threads[t].index = t;
+		g_threads[t].rand = 0x9e3779b97f4a7c15ULL * (t + 1);
+		g_threads[t].samples = malloc(LAT_SAMPLES_PER_THREAD * sizeof(uint32_t));
+	}
+
+	static phase_result results[MAX_PHASES];
+
+	fprintf(g_json, "{\n  \"suite\": \"devbench\",\n  \"timestamp\": %ld,\n  \"device\": \"%s\",\n"
+			"  \"config\": {\"seconds\": %" PRIu32 ", \"repetitions\": %" PRIu32 ", \"threads\": %" PRIu32
+			", \"read_pct\": %" PRIu32 ", \"record_bytes\": %" PRIu32 ", \"columns\": %" PRIu32
+			", \"span_bytes\": %" PRIu64 ", \"durability\": \"%s\"},\n  \"benchmarks\": [\n", (long)time(NULL),
+			argv[1], seconds, repetitions, num_threads, read_pct, record_bytes, columns, span_bytes, durability);
+
+	for (p = 0; p < num_phases; p++) {
+		const phase* ph = &phases[p];
+
+		for (r = 0; r < repetitions; r++) {
+			if (! run_phase(ph, seconds, &results[p], r)) {
+				return -1;
+			}
+			fprintf(stderr, " - %-19s %2" PRIu32 ": %10.0f IOPS  p50 %8.1f us  p99 %8.1f us  p99.9 %8.1f us"
+					"  cpu %5.1f%%\n", ph->name, r, results[p].iops[r], results[p].p50_us[r],
+					results[p].p99_us[r], results[p].p999_us[r], results[p].cpu_pct[r]);
+		}
+
+		fprintf(g_json, "    {\"name\": \"%s\", \"read_pct\": %" PRIu32 ", \"threads\": %" PRIu32
+				", \"poll\": \"%s\", \"metrics\": {\n", ph->name, ph->read_pct, ph->threads,
+				POLL_NAMES[ph->poll_mode]);
+		print_metric("iops", "ops/s", results[p].iops, repetitions, false);
+		print_metric("bandwidth_mbps", "MiB/s", results[p].bandwidth_mbps, repetitions, false);
+		print_metric("p50_us", "us", results[p].p50_us, repetitions, false);
+		print_metric("p99_us", "us", results[p].p99_us, repetitions, false);
+		print_metric("p999_us", "us", results[p].p999_us, repetitions, false);
+		print_metric("cpu_pct", "%", results[p].cpu_pct, repetitions, true);
+		fprintf(g_json, "    }}%s\n", p == num_phases - 1 ? "" : ",");
+	}
+	fprintf(g_json, "  ]\n}\n");
+
+	return 0;
+}
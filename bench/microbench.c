@@ -0,0 +1,569 @@
+/*
+	S1Search Research 
+	Raw Device Access: microbenchmarks for the in-memory hot paths
+
+	Usage: ./bench/microbench [repetitions] > result.json
+	Runs against a RAM-backed stand-in for the device (a memfd), so no SSD
+	is needed. Each case is repeated and reported as ns/op and TSC
+	cycles/op; JSON goes to stdout, progress to stderr. The codecs are
+	self-checked first, and a wrong result aborts before any timing.
+*/
+
+#define _GNU_SOURCE // memfd_create
+#include <math.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "../raw.c"
+
+//======================================================================================================
+// Constants
+//
+#define BENCH_DEVICE_BYTES (256ULL << 20)
+#define BENCH_COLUMNS 8
+#define BENCH_MIN_REP_NS 5000000 // calibrate iterations to 5ms per repetition
+#define BENCH_MAX_REPETITIONS 100
+
+//======================================================================================================
+// Typedefs
+//
+typedef uint64_t (*bench_fn)(uint64_t iterations);
+
+typedef struct _bench_case {
+	const char* name;
+	bench_fn fn;
+	uint32_t bytes; // processed per op, to report GB/s (0 - not a throughput case)
+} bench_case;
+
+//======================================================================================================
+// Globals
+//
+static FILE* g_json; // stdout; the library's own prints are sent to stderr
+static uint8_t* g_sector;
+static uint8_t* g_crc_data;
+static double g_case_ratio; // set by codec cases - input bytes over output bytes
+static lz4b_dict g_dict;
+static char g_json_page[4096];
+static char g_json_record[256];
+static uint32_t g_json_record_bytes;
+static uint8_t g_packed_page[LZ4B_BOUND(4096)];
+static uint8_t g_packed_record[LZ4B_BOUND(256)];
+static uint32_t g_packed_page_bytes, g_packed_record_bytes;
+static uint64_t g_num_divisions;
+
+//======================================================================================================
+// Device Stand-in
+//
+
+//------------------------------------------------
+// Point the library at a memfd instead of a block device.
+//
+static bool bench_device_init(uint64_t bytes, uint32_t columns) {
+	int fd = memfd_create("raw-bench", 0);
+
+	if (fd == -1 || ftruncate(fd, bytes) != 0) {
+		fprintf(stderr, "=> ERROR: couldn't create RAM device\n");
+		return false;
+	}
+
+	g_fd_device = fd;
+	g_ref_tab_columns = columns;
+
+	if (! config_parse_device_name("ram")) {
+		return false;
+	}
+
+	g_device->num_large_blocks = bytes / g_large_block_ops_bytes;
+	g_device->min_op_bytes = LO_IO_MIN_SIZE;
+	g_device->read_bytes = LO_IO_MIN_SIZE;
+	g_device->num_read_offsets = bytes / LO_IO_MIN_SIZE;
+
+	return create_ref_tab(g_device) && create_size_classes(g_device);
+}
+
+//======================================================================================================
+// Cases
+//
+
+//------------------------------------------------
+// Bitmap lookup.
+//
+static uint64_t bench_is_sector_free(uint64_t iterations) {
+	uint64_t i, sink = 0;
+	for (i = 0; i < iterations; i++) {
+		uint64_t bit = (i * 7919) % g_num_divisions;
+		sink += is_sector_free(bit / BENCH_COLUMNS, bit % BENCH_COLUMNS);
+	}
+	return sink;
+}
+
+//------------------------------------------------
+// Bitmap set and clear.
+//
+static uint64_t bench_add_erase_sector_ref(uint64_t iterations) {
+	uint64_t i;
+	for (i = 0; i < iterations; i++) {
+		// Past the pre-filled front so every add really flips a bit.
+		uint64_t bit = g_num_divisions / 2 + (i * 7919) % (g_num_divisions / 2);
+		add_sector_ref(bit / BENCH_COLUMNS, bit % BENCH_COLUMNS);
+		erase_sector_ref(bit / BENCH_COLUMNS, bit % BENCH_COLUMNS);
+	}
+	return iterations;
+}
+
+//------------------------------------------------
+// Free-bit scan, first fit over a pre-filled front.
+//
+static uint64_t bench_get_available_subsector(uint64_t iterations) {
+	long positions[8];
+	uint64_t i, sink = 0;
+	for (i = 0; i < iterations; i++) {
+		getAvailableSubsectorJNA(8 * (LO_IO_MIN_SIZE / BENCH_COLUMNS), positions);
+		sink += positions[0];
+	}
+	return sink;
+}
+
+//------------------------------------------------
+// Record slot allocation and release.
+//
+static uint64_t bench_alloc_free_record(uint64_t iterations) {
+	uint64_t i, sink = 0;
+	for (i = 0; i < iterations; i++) {
+		int64_t record = allocRecordJNA(200);
+		freeRecordJNA((uint64_t)record);
+		sink += record;
+	}
+	return sink;
+}
+
+//------------------------------------------------
+// Patch one division of a sector buffer.
+//
+static uint64_t bench_patch_sector_div(uint64_t iterations) {
+	uint64_t i;
+	for (i = 0; i < iterations; i++) {
+		patch_sector_div(g_sector, i % BENCH_COLUMNS, "Hello SSD.Hello SSD.", 21);
+	}
+	return g_sector[0];
+}
+
+//------------------------------------------------
+// Read-modify of a sector from the RAM device.
+//
+static uint64_t bench_prep_to_sector_div(uint64_t iterations) {
+	uint64_t i;
+	for (i = 0; i < iterations; i++) {
+		uint64_t offset = ((i * 7919) % g_device->num_read_offsets) * g_device->min_op_bytes;
+		prep_to_sector_div(offset, i % BENCH_COLUMNS, g_sector, "Hello SSD.", 11);
+	}
+	return g_sector[0];
+}
+
+//------------------------------------------------
+// Aligned buffer allocation, as every JNA call does.
+//
+static uint64_t bench_cf_valloc(uint64_t iterations) {
+	uint64_t i, sink = 0;
+	for (i = 0; i < iterations; i++) {
+		uint8_t* p_buffer = cf_valloc(4096);
+		sink += (uint64_t)p_buffer;
+		free(p_buffer);
+	}
+	return sink;
+}
+
+//------------------------------------------------
+// Full readJNA on a referenced division of the RAM device.
+//
+static uint64_t bench_read_jna(uint64_t iterations) {
+	uint64_t i, sink = 0;
+	for (i = 0; i < iterations; i++) {
+		char* message = readJNA((i * 7919) % (g_num_divisions / 2), 64);
+		sink += message ? (uint64_t)message[0] : 0;
+	}
+	return sink;
+}
+
+//------------------------------------------------
+// Full writeJNA, erasing first so the division is free.
+//
+static uint64_t bench_write_jna(uint64_t iterations) {
+	uint64_t i, sink = 0;
+	for (i = 0; i < iterations; i++) {
+		uint64_t division = (i * 7919) % (g_num_divisions / 2);
+		eraseSubsectorJNA(division);
+		sink += writeJNA(division, "Hello SSD.", 11);
+	}
+	return sink;
+}
+
+//------------------------------------------------
+// CRC32C of a sub-sector and of a page, hardware and table paths.
+//
+static uint64_t bench_crc32c_512(uint64_t iterations) {
+	uint64_t i, sink = 0;
+	for (i = 0; i < iterations; i++) {
+		sink += crc32c((uint32_t)i, g_crc_data, 512);
+	}
+	return sink;
+}
+
+static uint64_t bench_crc32c_4k(uint64_t iterations) {
+	uint64_t i, sink = 0;
+	for (i = 0; i < iterations; i++) {
+		sink += crc32c((uint32_t)i, g_crc_data, 4096);
+	}
+	return sink;
+}
+
+static uint64_t bench_crc32c_soft_4k(uint64_t iterations) {
+	uint64_t i, sink = 0;
+	for (i = 0; i < iterations; i++) {
+		sink += crc32c_soft((uint32_t)i, g_crc_data, 4096);
+	}
+	return sink;
+}
+
+//------------------------------------------------
+// LZ4 on a page of JSON records, and on one record against a dictionary.
+//
+static uint64_t bench_lz4_compress_page(uint64_t iterations) {
+	uint64_t i, sink = 0;
+	for (i = 0; i < iterations; i++) {
+		sink += lz4b_compress((uint8_t*)g_json_page, sizeof(g_json_page), g_packed_page,
+				sizeof(g_packed_page), NULL);
+	}
+	g_case_ratio = (double)sizeof(g_json_page) / g_packed_page_bytes;
+	return sink;
+}
+
+static uint64_t bench_lz4_decompress_page(uint64_t iterations) {
+	uint8_t out[sizeof(g_json_page)];
+	uint64_t i, sink = 0;
+	for (i = 0; i < iterations; i++) {
+		sink += lz4b_decompress(g_packed_page, g_packed_page_bytes, out, sizeof(out), NULL);
+	}
+	return sink;
+}
+
+static uint64_t bench_lz4_dict_compress_record(uint64_t iterations) {
+	uint64_t i, sink = 0;
+	for (i = 0; i < iterations; i++) {
+		sink += lz4b_compress((uint8_t*)g_json_record, g_json_record_bytes, g_packed_record,
+				sizeof(g_packed_record), &g_dict);
+	}
+	g_case_ratio = (double)g_json_record_bytes / g_packed_record_bytes;
+	return sink;
+}
+
+static uint64_t bench_lz4_dict_decompress_record(uint64_t iterations) {
+	uint8_t out[sizeof(g_json_record)];
+	uint64_t i, sink = 0;
+	for (i = 0; i < iterations; i++) {
+		sink += lz4b_decompress(g_packed_record, g_packed_record_bytes, out, sizeof(out), &g_dict);
+	}
+	return sink;
+}
+
+//------------------------------------------------
+// Compressed record round trip through the size classes on the RAM device.
+//
+static uint64_t bench_put_get_record(uint64_t iterations) {
+	char out[sizeof(g_json_record)];
+	uint64_t i, sink = 0;
+	for (i = 0; i < iterations; i++) {
+		int64_t record = putRecordJNA(g_json_record, g_json_record_bytes);
+		sink += getRecordJNA((uint64_t)record, out, sizeof(out));
+		freeRecordJNA((uint64_t)record);
+	}
+	return sink;
+}
+
+const bench_case CASES[] = {
+	{ "is_sector_free", bench_is_sector_free },
+	{ "add_erase_sector_ref", bench_add_erase_sector_ref },
+	{ "get_available_subsector", bench_get_available_subsector },
+	{ "alloc_free_record", bench_alloc_free_record },
+	{ "patch_sector_div", bench_patch_sector_div },
+	{ "prep_to_sector_div", bench_prep_to_sector_div },
+	{ "cf_valloc", bench_cf_valloc },
+	{ "read_jna", bench_read_jna },
+	{ "write_jna", bench_write_jna },
+	{ "crc32c_512", bench_crc32c_512, 512 },
+	{ "crc32c_4k", bench_crc32c_4k, 4096 },
+	{ "crc32c_soft_4k", bench_crc32c_soft_4k, 4096 },
+	{ "lz4_compress_json_4k", bench_lz4_compress_page, 4096 },
+	{ "lz4_decompress_json_4k", bench_lz4_decompress_page, 4096 },
+	{ "lz4_dict_compress_record", bench_lz4_dict_compress_record },
+	{ "lz4_dict_decompress_record", bench_lz4_dict_decompress_record },
+	{ "put_get_record_dict", bench_put_get_record }
+};
+#define NUM_CASES (sizeof(CASES) / sizeof(CASES[0]))
+
+//======================================================================================================
+// Self-checks
+//
+
+//------------------------------------------------
+// Abort on a wrong result - a fast codec that is wrong is no use.
+//
+static void check(bool ok, const char* what) {
+	if (! ok) {
+		fprintf(stderr, "=> ERROR: self-check failed: %s\n", what);
+		abort();
+	}
+}
+
+//------------------------------------------------
+// CRC32C against the standard check value and the table path, and sealed
+// sub-sectors against corruption.
+//
+static void check_crc32c() {
+	uint8_t div[LO_IO_MIN_SIZE / BENCH_COLUMNS];
+	uint32_t len, offset, bytes;
+	const uint8_t* payload;
+	bool checksums = g_checksums;
+
+	check(crc32c(0, "123456789", 9) == 0xE3069283, "crc32c check value");
+
+	// Every alignment and tail length the hardware path splits on.
+	for (offset = 0; offset < 16; offset++) {
+		for (bytes = 0; bytes + offset <= 4096; bytes += bytes < 64 ? 1 : 509) {
+			check(crc32c(offset, g_crc_data + offset, bytes) == crc32c_soft(offset, g_crc_data + offset, bytes),
+					"crc32c matches crc32c_soft");
+		}
+	}
+
+	g_checksums = true;
+	memset(div, 0, sizeof(div));
+	seal_sector_div(div, sizeof(div), "Hello SSD.", 11);
+	check(open_sector_div(div, sizeof(div), &payload, &len) == RAW_OK && len == 10 &&
+			memcmp(payload, "Hello SSD.", 10) == 0, "sealed sub-sector opens");
+
+	div[SUBSECTOR_HEADER_BYTES] ^= 1;
+	check(open_sector_div(div, sizeof(div), &payload, &len) == RAW_ERR_CORRUPT, "CRC mismatch is corrupt");
+
+	div[SUBSECTOR_HEADER_BYTES] ^= 1;
+	div[2] = 0xff; // length past the end of the division
+	check(open_sector_div(div, sizeof(div), &payload, &len) == RAW_ERR_CORRUPT, "truncated header is corrupt");
+
+	memset(div, 0, sizeof(div));
+	check(open_sector_div(div, sizeof(div), &payload, &len) == RAW_ERR_CORRUPT, "blank sub-sector is corrupt");
+	g_checksums = checksums;
+}
+
+//------------------------------------------------
+// LZ4 round trips with and without the dictionary, and packed records
+// against corruption. Needs the JSON samples and compression set up.
+//
+static void check_lz4() {
+	static uint8_t input[4096], packed[LZ4B_BOUND(4096)], out[4096];
+	static uint8_t record[RECORD_HEADER_BYTES + LZ4B_BOUND(4096)];
+	const lz4b_dict* dicts[] = { NULL, &g_dict };
+	uint32_t d, kind, bytes, stored;
+	int32_t result;
+
+	for (d = 0; d < 2; d++) {
+		for (kind = 0; kind < 3; kind++) {
+			for (bytes = 1; bytes <= sizeof(input); bytes += bytes < 32 ? 1 : 331) {
+				// JSON, incompressible and all-zero inputs.
+				memcpy(input, kind == 0 ? (uint8_t*)g_json_page : g_crc_data, bytes);
+				if (kind == 2) {
+					memset(input, 0, bytes);
+				}
+
+				stored = lz4b_compress(input, bytes, packed, sizeof(packed), dicts[d]);
+				check(stored > 0, "lz4b_compress fits its bound");
+				check(lz4b_decompress(packed, stored, out, bytes, dicts[d]) == (int32_t)bytes &&
+						memcmp(out, input, bytes) == 0, d ? "lz4b round trip with dictionary" :
+						"lz4b round trip");
+			}
+		}
+	}
+
+	stored = record_pack(g_json_record, g_json_record_bytes, record);
+	check((record[3] & RECORD_LZ4) && (record[3] & RECORD_DICT), "record compressed against dictionary");
+	result = record_unpack(record, stored, (char*)out, sizeof(out));
+	check(result == (int32_t)g_json_record_bytes && memcmp(out, g_json_record, result) == 0,
+			"record round trip");
+
+	record[RECORD_HEADER_BYTES + stored / 2] ^= 0x20;
+	check(record_unpack(record, stored, (char*)out, sizeof(out)) == RAW_ERR_CORRUPT,
+			"damaged record is corrupt");
+	record[RECORD_HEADER_BYTES + stored / 2] ^= 0x20;
+
+	check(record_unpack(record, stored - 1, (char*)out, sizeof(out)) == RAW_ERR_CORRUPT,
+			"truncated record is corrupt");
+
+	record[0] ^= 0xff; // stored bytes no longer match the payload
+	check(record_unpack(record, stored, (char*)out, sizeof(out)) == RAW_ERR_CORRUPT,
+			"bad record header is corrupt");
+}
+
+//======================================================================================================
+// Helpers
+//
+
+//------------------------------------------------
+// One synthetic JSON record, as our text-heavy payloads look.
+//
+static uint32_t json_record(char* dest, uint32_t id) {
+	return (uint32_t)sprintf(dest, "{\"id\":%" PRIu32 ",\"name\":\"user-%" PRIu32 "\",\"email\":\"user%"
+			PRIu32 "@example.com\",\"active\":%s,\"tags\":[\"alpha\",\"beta\"],\"score\":%" PRIu32 ".%03"
+			PRIu32 "}", id, id % 100000, id % 1000000, id % 2 ? "true" : "false", id % 100, id % 1000);
+}
+
+//------------------------------------------------
+// Order doubles ascending.
+//
+static int compare_double(const void* a, const void* b) {
+	double da = *(const double*)a, db = *(const double*)b;
+	return da < db ? -1 : da > db;
+}
+
+//------------------------------------------------
+// Grow the iteration count until one repetition takes long enough to time.
+//
+static uint64_t calibrate(bench_fn fn) {
+	uint64_t iterations = 1;
+
+	while (true) {
+		uint64_t start_ns = cf_getns();
+		fn(iterations);
+		if (cf_getns() - start_ns >= BENCH_MIN_REP_NS || iterations >= (1ULL << 32)) {
+			return iterations;
+		}
+		iterations *= 2;
+	}
+}
+
+//------------------------------------------------
+// Run one case and print it as a JSON object.
+//
+static void run_case(const bench_case* bc, uint32_t repetitions, bool last) {
+	double ns[BENCH_MAX_REPETITIONS], cycles[BENCH_MAX_REPETITIONS];
+	double mean = 0, var = 0;
+	uint64_t iterations = calibrate(bc->fn), sink = 0;
+	uint32_t r;
+
+	for (r = 0; r < repetitions; r++) {
+		uint64_t start_ns = cf_getns(), start_ticks = cf_ticks_serial();
+		sink += bc->fn(iterations);
+		uint64_t stop_ticks = cf_ticks_serial(), stop_ns = cf_getns();
+
+		ns[r] = (double)(stop_ns - start_ns) / iterations;
+		cycles[r] = (double)(stop_ticks - start_ticks) / iterations;
+		mean += ns[r];
+	}
+	__asm__ volatile("" : : "r"(sink));
+
+	mean /= repetitions;
+	for (r = 0; r < repetitions; r++) {
+		var += (ns[r] - mean) * (ns[r] - mean);
+	}
+	var = repetitions > 1 ? var / (repetitions - 1) : 0;
+
+	fprintf(g_json, "    {\"name\": \"%s\", \"unit\": \"ns/op\", \"iterations\": %" PRIu64 ", \"samples\": [",
+			bc->name, iterations);
+	for (r = 0; r < repetitions; r++) {
+		fprintf(g_json, "%s%.3f", r ? ", " : "", ns[r]);
+	}
+
+	qsort(ns, repetitions, sizeof(double), compare_double);
+	qsort(cycles, repetitions, sizeof(double), compare_double);
+
+	fprintf(g_json, "], \"median\": %.3f, \"mean\": %.3f, \"stddev\": %.3f, \"min\": %.3f, \"max\": %.3f, "
+			"\"cycles_per_op\": %.1f", ns[repetitions / 2], mean, sqrt(var), ns[0],
+			ns[repetitions - 1], cycles[repetitions / 2]);
+	if (bc->bytes) {
+		fprintf(g_json, ", \"gb_per_s\": %.3f", bc->bytes / ns[repetitions / 2]);
+	}
+	if (g_case_ratio) {
+		fprintf(g_json, ", \"ratio\": %.3f", g_case_ratio);
+	}
+	fprintf(g_json, "}%s\n", last ? "" : ",");
+
+	fprintf(stderr, " - %-24s %10.1f ns/op %10.1f cycles/op", bc->name, ns[repetitions / 2],
+			cycles[repetitions / 2]);
+	if (bc->bytes) {
+		fprintf(stderr, " %8.2f GB/s", bc->bytes / ns[repetitions / 2]);
+	}
+	if (g_case_ratio) {
+		fprintf(stderr, " ratio %.2f", g_case_ratio);
+	}
+	fprintf(stderr, "\n");
+	g_case_ratio = 0;
+}
+
+//======================================================================================================
+// Main
+//
+int main(int argc, char* argv[]) {
+	uint32_t repetitions = argc > 1 ? (uint32_t)atoi(argv[1]) : 15;
+	uint64_t i;
+
+	if (repetitions < 1 || repetitions > BENCH_MAX_REPETITIONS) {
+		fprintf(stderr, "=> ERROR: repetitions must be 1 to %d\n", BENCH_MAX_REPETITIONS);
+		return -1;
+	}
+
+	g_json = fdopen(dup(STDOUT_FILENO), "w");
+	dup2(STDERR_FILENO, STDOUT_FILENO);
+
+	fprintf(stderr, "=> Raw Device Access - microbenchmarks (%" PRIu32 " repetitions)\n", repetitions);
+
+	if (! bench_device_init(BENCH_DEVICE_BYTES, BENCH_COLUMNS) ||
+			! (g_sector = cf_valloc(g_device->read_bytes))) {
+		return -1;
+	}
+	memset(g_sector, 0, g_device->read_bytes);
+	if (! (g_crc_data = cf_valloc(4096))) {
+		return -1;
+	}
+	for (i = 0; i < 4096; i++) {
+		g_crc_data[i] = (uint8_t)rand();
+	}
+	crc32c_init();
+	check_crc32c();
+
+	// Synthetic JSON records: a page of them, a dictionary of others, and one alone.
+	static char samples[32768];
+	uint32_t page_bytes = 0, dict_bytes = 0;
+
+	while (page_bytes < sizeof(g_json_page)) {
+		char record[256];
+		uint32_t n = json_record(record, (uint32_t)rand());
+		uint32_t fit = sizeof(g_json_page) - page_bytes;
+
+		memcpy(g_json_page + page_bytes, record, n < fit ? n : fit);
+		page_bytes += n < fit ? n : fit;
+	}
+	while (dict_bytes + 256 < sizeof(samples)) {
+		dict_bytes += json_record(samples + dict_bytes, (uint32_t)rand());
+	}
+	lz4b_dict_init(&g_dict, (uint8_t*)samples, dict_bytes);
+	g_json_record_bytes = json_record(g_json_record, 424242);
+	g_packed_page_bytes = lz4b_compress((uint8_t*)g_json_page, sizeof(g_json_page), g_packed_page,
+			sizeof(g_packed_page), NULL);
+	g_packed_record_bytes = lz4b_compress((uint8_t*)g_json_record, g_json_record_bytes, g_packed_record,
+			sizeof(g_packed_record), &g_dict);
+	setCompressionJNA(true, samples, dict_bytes);
+	check_lz4();
+	g_num_divisions = g_device->ref_tab.num_bits;
+	cf_ticks_init();
+
+	// Reference the front half, so scans have work to do and reads hit.
+	for (i = 0; i < g_num_divisions / 2; i++) {
+		add_sector_ref(i / BENCH_COLUMNS, i % BENCH_COLUMNS);
+	}
+
+	fprintf(g_json, "{\n  \"suite\": \"microbench\",\n  \"timestamp\": %ld,\n  \"repetitions\": %" PRIu32
+			",\n  \"benchmarks\": [\n", (long)time(NULL), repetitions);
+	for (i = 0; i < NUM_CASES; i++) {
+		run_case(&CASES[i], repetitions, i == NUM_CASES - 1);
+	}
+	fprintf(g_json, "  ]\n}\n");
+
+	return 0;
+}
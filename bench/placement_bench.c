@@ -0,0 +1,162 @@
+/*
+	S1Search Research
+	Raw Device Access: concurrent placement benchmark
+
+	Usage: ./bench/placement_bench [threads] [claims] [interleaved]
+	Has each thread claim bits of one table of reference under every
+	placement policy and reports ns/claim and how many bitmap words and
+	device sectors ended up written by more than one thread - shared words
+	bounce cache lines, shared sectors mean read-modify-write collisions.
+	interleaved - one thread steps through the shards in turn, the worst
+	case interleaving, for machines with fewer cores than threads.
+*/
+
+#include "../raw.c"
+
+//======================================================================================================
+// Constants
+//
+#define MAX_THREADS 64
+#define SECTOR_BITS 8 // 4K sectors of 512-byte sub_sectors
+#define BLOCK_BITS 256
+
+//======================================================================================================
+// Globals
+//
+static ref_map g_map;
+static uint8_t* g_owner; // thread + 1 per claimed bit
+static uint64_t g_claims;
+static pthread_barrier_t g_barrier;
+
+//======================================================================================================
+// Helpers
+//
+
+//------------------------------------------------
+// Claim g_claims bits as one thread.
+//
+static void* claim_op(void* arg) {
+	uint8_t id = (uint8_t)(uintptr_t)arg + 1;
+	uint64_t i, bit;
+
+	thread_shard();
+	pthread_barrier_wait(&g_barrier);
+
+	for (i = 0; i < g_claims && ref_map_claim(&g_map, &bit); i++) {
+		g_owner[bit] = id;
+	}
+	return NULL;
+}
+
+//------------------------------------------------
+// Of the units of 'span' bits holding claims, count those with more than
+// one owner.
+//
+static uint64_t count_shared(uint64_t num_bits, uint64_t span, uint64_t* p_used) {
+	uint64_t unit, bit, shared = 0, used = 0;
+
+	for (unit = 0; unit < num_bits / span; unit++) {
+		uint8_t first = 0;
+		bool multi = false;
+
+		for (bit = unit * span; bit < (unit + 1) * span; bit++) {
+			if (g_owner[bit] && ! first) {
+				first = g_owner[bit];
+			}
+			else if (g_owner[bit] && g_owner[bit] != first) {
+				multi = true;
+			}
+		}
+		used += first != 0;
+		shared += multi;
+	}
+
+	*p_used = used;
+	return shared;
+}
+
+//======================================================================================================
+// Main
+//
+int main(int argc, char* argv[]) {
+	uint32_t num_threads = argc > 1 ? atoi(argv[1]) : 8;
+	const char* policy_names[] = { "first_fit", "next_fit", "round_robin", "locality" };
+	bool interleaved = argc > 3 && strcmp(argv[3], "interleaved") == 0;
+	pthread_t threads[MAX_THREADS];
+	uint32_t policy, t;
+	uint64_t i, bit;
+
+	g_claims = argc > 2 ? strtoull(argv[2], NULL, 10) : 100000;
+
+	if (! num_threads || num_threads > MAX_THREADS || ! g_claims) {
+		printf("=> ERROR: bad arguments\n");
+		return -1;
+	}
+
+	// Every shard's stretch of the map holds its claims twice over, as it
+	// would on a device much larger than what the threads write.
+	uint64_t num_bits = PLACEMENT_SHARDS * g_claims * 2;
+
+	num_bits += BLOCK_BITS - num_bits % BLOCK_BITS;
+	g_owner = malloc(num_bits);
+
+	if (! g_owner) {
+		printf("=> ERROR: owner malloc()\n");
+		return -1;
+	}
+
+	printf("=> placement benchmark: %" PRIu32 " %s, %" PRIu64 " claims each\n", num_threads,
+			interleaved ? "interleaved shards" : "threads", g_claims);
+
+	for (policy = PLACEMENT_FIRST_FIT; policy <= PLACEMENT_LOCALITY; policy++) {
+		uint64_t words_used, sectors_used, start_ns;
+
+		g_placement_policy = policy;
+		g_next_shard = 0;
+		memset(g_owner, 0, num_bits);
+
+		if (! ref_map_init(&g_map, num_bits, false)) {
+			printf("=> ERROR: ref_map_init()\n");
+			return -1;
+		}
+		ref_map_set_geometry(&g_map, BLOCK_BITS, SECTOR_BITS);
+
+		if (interleaved) {
+			start_ns = cf_getns();
+			for (i = 0; i < g_claims; i++) {
+				for (t = 0; t < num_threads; t++) {
+					t_shard = t;
+					if (ref_map_claim(&g_map, &bit)) {
+						g_owner[bit] = t + 1;
+					}
+				}
+			}
+		}
+		else {
+			pthread_barrier_init(&g_barrier, NULL, num_threads + 1);
+			for (t = 0; t < num_threads; t++) {
+				pthread_create(&threads[t], NULL, claim_op, (void*)(uintptr_t)t);
+			}
+			pthread_barrier_wait(&g_barrier);
+			start_ns = cf_getns();
+			for (t = 0; t < num_threads; t++) {
+				pthread_join(threads[t], NULL);
+			}
+			pthread_barrier_destroy(&g_barrier);
+		}
+
+		double ns_per_claim = (double)(cf_getns() - start_ns) / (num_threads * g_claims);
+		uint64_t shared_words = count_shared(num_bits, 64, &words_used);
+		uint64_t shared_sectors = count_shared(num_bits, SECTOR_BITS, &sectors_used);
+
+		printf(" - %-11s %7.1f ns/claim  shared words %5.1f%%  shared sectors %5.1f%%\n",
+				policy_names[policy], ns_per_claim, 100.0 * shared_words / words_used,
+				100.0 * shared_sectors / sectors_used);
+
+		free(g_map.words);
+		free(g_map.cursors);
+	}
+
+	free(g_owner);
+	return 0;
+}
@@ -0,0 +1,102 @@
+/*
+	S1Search Research 
+	Raw Device Access: dense vs compressed table of reference benchmark
+
+	Usage: ./bench/ref_map_bench [bits] [ops]
+	Builds the same bitmap in both layouts - mostly full at the front, mostly
+	empty at the back, fragmented in between - and reports memory and ns/op.
+*/
+
+#include "../raw.c"
+
+//======================================================================================================
+// Helpers
+//
+
+//------------------------------------------------
+// Get a random 48-bit uint64_t.
+//
+static uint64_t rand_48() {
+	return ((uint64_t)rand() << 16) | ((uint64_t)rand() & 0xffffULL);
+}
+
+//------------------------------------------------
+// Fill 40% full, 10% fragmented at 50% density, the rest empty.
+//
+static void fill_map(ref_map* map) {
+	uint64_t full_end = (map->num_bits * 4) / 10;
+	uint64_t frag_end = full_end + map->num_bits / 10;
+	uint64_t bit;
+
+	for (bit = 0; bit < full_end; bit++) {
+		ref_map_set(map, bit);
+	}
+	for (bit = full_end; bit < frag_end; bit++) {
+		if (rand() & 1) {
+			ref_map_set(map, bit);
+		}
+	}
+}
+
+//------------------------------------------------
+// Time one operation over a prepared list of bits.
+//
+static double time_op(ref_map* map, const uint64_t* bits, uint64_t ops, int op) {
+	uint64_t i, sink = 0, start_ns = cf_getns();
+
+	for (i = 0; i < ops; i++) {
+		switch (op) {
+		case 0: sink += ref_map_test(map, bits[i]); break;
+		case 1: sink += ref_map_set(map, bits[i]); break;
+		case 2: sink += ref_map_clear(map, bits[i]); break;
+		default: sink += ref_map_next_free(map, bits[i]); break;
+		}
+	}
+
+	__asm__ volatile("" : : "r"(sink));
+	return (double)(cf_getns() - start_ns) / ops;
+}
+
+//======================================================================================================
+// Main
+//
+int main(int argc, char* argv[]) {
+	uint64_t num_bits = argc > 1 ? strtoull(argv[1], NULL, 10) : (1ULL << 30);
+	uint64_t ops = argc > 2 ? strtoull(argv[2], NULL, 10) : 1000000;
+	const char* op_names[] = { "test", "set", "clear", "next_free" };
+	uint64_t* bits = malloc(ops * sizeof(uint64_t));
+	uint64_t i;
+	int layout, op;
+
+	if (! bits) {
+		printf("=> ERROR: bits malloc()\n");
+		return -1;
+	}
+
+	printf("=> ref_map benchmark: %" PRIu64 " bits, %" PRIu64 " ops per case\n", num_bits, ops);
+
+	for (layout = 0; layout < 2; layout++) {
+		ref_map map;
+
+		srand(1);
+		if (! ref_map_init(&map, num_bits, layout == 1)) {
+			printf("=> ERROR: ref_map_init()\n");
+			return -1;
+		}
+		fill_map(&map);
+
+		printf("\n-> %s layout\n - memory: %" PRIu64 " bytes (%" PRIu64 " bits set)\n",
+				layout ? "compressed" : "dense", ref_map_bytes(&map), map.num_set);
+
+		// Touch the fragmented middle most, as allocation would.
+		for (op = 0; op < 4; op++) {
+			for (i = 0; i < ops; i++) {
+				bits[i] = (num_bits * 4) / 10 + rand_48() % (num_bits / 5);
+			}
+			printf(" - %-9s %8.1f ns/op\n", op_names[op], time_op(&map, bits, ops, op));
+		}
+	}
+
+	free(bits);
+	return 0;
+}
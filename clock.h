@@ -25,4 +25,93 @@ cf_getns()
 	struct timespec ts;
 	clock_gettime(CLOCK_MONOTONIC, &ts);
 	return (uint64_t)ts.tv_nsec + ((uint64_t)ts.tv_sec * 1000000000);
-}
\ No newline at end of file
+}
+
+// Invariant-TSC clock for per-op timing. cf_ticks() is a bare rdtsc and
+// cf_ticks_to_ns() one multiply and shift, so nothing on the hot path
+// divides or enters the kernel. Without an invariant TSC (or off x86) ticks
+// are plain cf_getns() nanoseconds and the conversion is the identity.
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define CF_HAS_TSC 1
+#endif
+
+#define CF_TICKS_SHIFT 32
+#define CF_TICKS_CALIBRATE_NS 20000000 // 20ms
+
+typedef struct cf_ticks_clock_s {
+	uint64_t mult; // ns = (ticks * mult) >> CF_TICKS_SHIFT
+	int tsc;
+	int calibrated;
+} cf_ticks_clock;
+
+static cf_ticks_clock g_cf_ticks = { (uint64_t)1 << CF_TICKS_SHIFT, 0, 0 };
+
+static inline uint64_t
+cf_ticks()
+{
+#ifdef CF_HAS_TSC
+	if (g_cf_ticks.tsc) {
+		return __rdtsc();
+	}
+#endif
+	return cf_getns();
+}
+
+// Waits for earlier instructions to finish and keeps later ones from
+// starting early - use to close a precise measurement.
+static inline uint64_t
+cf_ticks_serial()
+{
+#ifdef CF_HAS_TSC
+	if (g_cf_ticks.tsc) {
+		unsigned int aux;
+		uint64_t ticks = __rdtscp(&aux);
+		_mm_lfence();
+		return ticks;
+	}
+#endif
+	return cf_getns();
+}
+
+static inline uint64_t
+cf_ticks_to_ns(uint64_t ticks)
+{
+	return (uint64_t)(((unsigned __int128)ticks * g_cf_ticks.mult) >> CF_TICKS_SHIFT);
+}
+
+// Detect an invariant TSC and measure its rate against CLOCK_MONOTONIC.
+// Call once before relying on cf_ticks(); it is safe to call again.
+static inline int
+cf_ticks_init()
+{
+	if (g_cf_ticks.calibrated) {
+		return g_cf_ticks.tsc;
+	}
+
+#ifdef CF_HAS_TSC
+	unsigned int eax, ebx, ecx, edx;
+
+	// CPUID 0x80000007 EDX bit 8: TSC runs at a constant rate in all states.
+	if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) && (edx & (1 << 8))) {
+		uint64_t start_ns = cf_getns(), start_ticks = __rdtsc();
+		uint64_t stop_ns, stop_ticks;
+
+		do {
+			stop_ns = cf_getns();
+			stop_ticks = __rdtsc();
+		} while (stop_ns - start_ns < CF_TICKS_CALIBRATE_NS);
+
+		if (stop_ticks > start_ticks) {
+			g_cf_ticks.mult = (uint64_t)((((unsigned __int128)(stop_ns - start_ns)) << CF_TICKS_SHIFT) /
+					(stop_ticks - start_ticks));
+			g_cf_ticks.tsc = 1;
+		}
+	}
+#endif
+
+	g_cf_ticks.calibrated = 1;
+	return g_cf_ticks.tsc;
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// CRC32C (Castagnoli) for sub-sector headers. crc32c() runs on the SSE4.2 or
+// ARMv8 CRC instructions when the CPU has them and on a slicing-by-8 table
+// otherwise. Call crc32c_init() once before use. Chaining works:
+// crc32c(crc32c(0, a, n), b, m) is the CRC of a followed by b.
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <nmmintrin.h>
+#define CRC32C_HAS_SSE42 1
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#define CRC32C_HAS_ARMV8 1
+#define CRC32C_HWCAP_CRC32 (1 << 7)
+#endif
+
+#define CRC32C_POLY 0x82f63b78 // reflected
+
+typedef uint32_t (*crc32c_fn)(uint32_t crc, const uint8_t* p, size_t len);
+
+static uint32_t g_crc32c_table[8][256];
+
+static inline uint64_t
+crc32c_load64(const uint8_t* p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+// Table fallback, eight bytes per step. Assumes a little-endian host.
+static uint32_t
+crc32c_sw(uint32_t crc, const uint8_t* p, size_t len)
+{
+	while (len >= 8) {
+		uint64_t v = crc32c_load64(p) ^ crc;
+
+		crc = g_crc32c_table[7][v & 0xff] ^ g_crc32c_table[6][(v >> 8) & 0xff] ^
+				g_crc32c_table[5][(v >> 16) & 0xff] ^ g_crc32c_table[4][(v >> 24) & 0xff] ^
+				g_crc32c_table[3][(v >> 32) & 0xff] ^ g_crc32c_table[2][(v >> 40) & 0xff] ^
+				g_crc32c_table[1][(v >> 48) & 0xff] ^ g_crc32c_table[0][v >> 56];
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--) {
+		crc = g_crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+
+	return crc;
+}
+
+#ifdef CRC32C_HAS_SSE42
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_hw(uint32_t crc, const uint8_t* p, size_t len)
+{
+	uint64_t c = crc;
+
+	while (len >= 8) {
+		c = _mm_crc32_u64(c, crc32c_load64(p));
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--) {
+		c = _mm_crc32_u8((uint32_t)c, *p++);
+	}
+
+	return (uint32_t)c;
+}
+#endif
+
+#ifdef CRC32C_HAS_ARMV8
+__attribute__((target("+crc"))) static uint32_t
+crc32c_hw(uint32_t crc, const uint8_t* p, size_t len)
+{
+	while (len >= 8) {
+		crc = __crc32cd(crc, crc32c_load64(p));
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--) {
+		crc = __crc32cb(crc, *p++);
+	}
+
+	return crc;
+}
+#endif
+
+static crc32c_fn g_crc32c = crc32c_sw;
+
+// True when the CRC instruction is in use.
+static inline int
+crc32c_hw_enabled()
+{
+	return g_crc32c != crc32c_sw;
+}
+
+static inline uint32_t
+crc32c(uint32_t crc, const void* buf, size_t len)
+{
+	return ~g_crc32c(~crc, (const uint8_t*)buf, len);
+}
+
+// Software path regardless of the CPU - for tests and benchmarks.
+static inline uint32_t
+crc32c_soft(uint32_t crc, const void* buf, size_t len)
+{
+	return ~crc32c_sw(~crc, (const uint8_t*)buf, len);
+}
+
+static void
+crc32c_init()
+{
+	uint32_t i, j;
+
+	for (i = 0; i < 256; i++) {
+		uint32_t crc = i;
+
+		for (j = 0; j < 8; j++) {
+			crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+		}
+		g_crc32c_table[0][i] = crc;
+	}
+
+	for (i = 0; i < 256; i++) {
+		for (j = 1; j < 8; j++) {
+			g_crc32c_table[j][i] = g_crc32c_table[0][g_crc32c_table[j - 1][i] & 0xff] ^
+					(g_crc32c_table[j - 1][i] >> 8);
+		}
+	}
+
+#if defined(CRC32C_HAS_SSE42)
+	unsigned int eax, ebx, ecx, edx;
+
+	// CPUID 1 ECX bit 20: SSE4.2.
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & (1 << 20))) {
+		g_crc32c = crc32c_hw;
+	}
+#elif defined(CRC32C_HAS_ARMV8)
+	if (getauxval(AT_HWCAP) & CRC32C_HWCAP_CRC32) {
+		g_crc32c = crc32c_hw;
+	}
+#endif
+}
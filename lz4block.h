@@ -0,0 +1,316 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// LZ4 block format codec for record payloads. lz4b_compress() is the greedy
+// single-probe LZ4 match finder; its output without a dictionary decodes with
+// stock LZ4_decompress_safe(). With a dictionary, matches may also reach back
+// into up to 64K of sample text sitting virtually in front of the input -
+// LZ4's external dictionary - which is what lets records of a few hundred
+// bytes compress at all. The dictionary is indexed once by lz4b_dict_init()
+// and is only read afterwards, so threads can share it.
+
+#define LZ4B_MIN_MATCH 4
+#define LZ4B_LAST_LITERALS 5 // the block always ends with this many literals
+#define LZ4B_MF_LIMIT 12 // no match starts this close to the end
+#define LZ4B_MAX_OFFSET 65535
+#define LZ4B_MAX_DICT 65536
+#define LZ4B_HASH_LOG 12
+#define LZ4B_SKIP_TRIGGER 6 // step grows by one every 64 failed probes
+
+// Worst case compressed size of len bytes.
+#define LZ4B_BOUND(len) ((len) + (len) / 255 + 16)
+
+typedef struct lz4b_dict_s {
+	uint32_t len;
+	uint32_t table[1 << LZ4B_HASH_LOG]; // dictionary position + 1, 0 - empty
+	uint8_t data[LZ4B_MAX_DICT];
+} lz4b_dict;
+
+static inline uint32_t
+lz4b_read32(const uint8_t* p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+// Length of the common prefix of a and b, up to max. Assumes little-endian.
+static inline uint32_t
+lz4b_count(const uint8_t* a, const uint8_t* b, uint32_t max)
+{
+	uint32_t n = 0;
+
+	while (n + 8 <= max) {
+		uint64_t va, vb;
+
+		memcpy(&va, a + n, sizeof(va));
+		memcpy(&vb, b + n, sizeof(vb));
+		if (va != vb) {
+			return n + (__builtin_ctzll(va ^ vb) >> 3);
+		}
+		n += 8;
+	}
+
+	while (n < max && a[n] == b[n]) {
+		n++;
+	}
+	return n;
+}
+
+static inline uint32_t
+lz4b_hash(uint32_t v, uint32_t log)
+{
+	return (v * 2654435761U) >> (32 - log);
+}
+
+static inline uint8_t*
+lz4b_put_length(uint8_t* op, uint32_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+// Keep the last 64K of the samples and index every position in them.
+static void
+lz4b_dict_init(lz4b_dict* dict, const uint8_t* data, uint32_t len)
+{
+	uint32_t p;
+
+	if (len > LZ4B_MAX_DICT) {
+		data += len - LZ4B_MAX_DICT;
+		len = LZ4B_MAX_DICT;
+	}
+
+	memcpy(dict->data, data, len);
+	memset(dict->table, 0, sizeof(dict->table));
+	dict->len = len;
+
+	for (p = 0; p + LZ4B_MIN_MATCH <= len; p++) {
+		dict->table[lz4b_hash(lz4b_read32(dict->data + p), LZ4B_HASH_LOG)] = p + 1;
+	}
+}
+
+// Compress src into dst. Returns the compressed size, or 0 if it doesn't fit
+// in dst_cap. dict may be NULL.
+static uint32_t
+lz4b_compress(const uint8_t* src, uint32_t src_len, uint8_t* dst, uint32_t dst_cap,
+		const lz4b_dict* dict)
+{
+	uint32_t table[1 << LZ4B_HASH_LOG];
+	uint32_t log = 8, dict_len = dict ? dict->len : 0;
+	const uint8_t* ip = src;
+	const uint8_t* anchor = src;
+	const uint8_t* end = src + src_len;
+	const uint8_t* match_limit = end;
+	const uint8_t* mf_limit = src; // inputs this short are all literals
+	uint8_t* op = dst;
+	uint8_t* op_end = dst + dst_cap;
+	uint32_t lit_len;
+
+	if (src_len > LZ4B_MF_LIMIT) {
+		match_limit = end - LZ4B_LAST_LITERALS;
+		mf_limit = end - LZ4B_MF_LIMIT;
+
+		// Size the input's table to the input, so tiny records clear little.
+		while (log < LZ4B_HASH_LOG && (1U << log) < src_len) {
+			log++;
+		}
+		memset(table, 0, sizeof(uint32_t) << log);
+	}
+
+	while (ip < mf_limit) {
+		uint32_t v = lz4b_read32(ip);
+		uint32_t h = lz4b_hash(v, log);
+		uint32_t cand = table[h];
+		uint32_t offset = 0, match_len = LZ4B_MIN_MATCH;
+
+		table[h] = (uint32_t)(ip - src) + 1;
+
+		if (cand && (uint32_t)(ip - src) - (cand - 1) <= LZ4B_MAX_OFFSET &&
+				lz4b_read32(src + cand - 1) == v) {
+			const uint8_t* match = src + cand - 1;
+
+			// Catch up over literals that also match.
+			while (ip > anchor && match > src && ip[-1] == match[-1]) {
+				ip--;
+				match--;
+			}
+
+			match_len += lz4b_count(ip + match_len, match + match_len,
+					(uint32_t)(match_limit - ip) - match_len);
+			offset = (uint32_t)(ip - match);
+		}
+		else if (dict) {
+			uint32_t dc = dict->table[lz4b_hash(v, LZ4B_HASH_LOG)];
+
+			if (dc && (uint32_t)(ip - src) + dict_len - (dc - 1) <= LZ4B_MAX_OFFSET &&
+					lz4b_read32(dict->data + dc - 1) == v) {
+				const uint8_t* match = dict->data + dc - 1;
+				const uint8_t* dict_end = dict->data + dict_len;
+
+				uint32_t max = (uint32_t)(match_limit - ip);
+
+				if (max > (uint32_t)(dict_end - match)) {
+					max = (uint32_t)(dict_end - match);
+				}
+				match_len += lz4b_count(ip + match_len, match + match_len, max - match_len);
+
+				// Ran off the end of the dictionary - the input follows it.
+				if (match + match_len == dict_end) {
+					match_len += lz4b_count(ip + match_len, src, (uint32_t)(match_limit - ip) - match_len);
+				}
+				offset = (uint32_t)(ip - src) + dict_len - (dc - 1);
+			}
+		}
+
+		if (! offset) {
+			ip += 1 + ((ip - anchor) >> LZ4B_SKIP_TRIGGER);
+			continue;
+		}
+
+		lit_len = (uint32_t)(ip - anchor);
+		if (op + 1 + lit_len / 255 + 1 + lit_len + 2 + (match_len - LZ4B_MIN_MATCH) / 255 + 1 > op_end) {
+			return 0;
+		}
+
+		uint8_t* token = op++;
+
+		*token = (uint8_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+		if (lit_len >= 15) {
+			op = lz4b_put_length(op, lit_len - 15);
+		}
+		memcpy(op, anchor, lit_len);
+		op += lit_len;
+
+		*op++ = (uint8_t)offset;
+		*op++ = (uint8_t)(offset >> 8);
+
+		uint32_t ml = match_len - LZ4B_MIN_MATCH;
+
+		*token |= (uint8_t)(ml >= 15 ? 15 : ml);
+		if (ml >= 15) {
+			op = lz4b_put_length(op, ml - 15);
+		}
+
+		ip += match_len;
+		anchor = ip;
+	}
+
+	lit_len = (uint32_t)(end - anchor);
+	if (op + 1 + lit_len / 255 + 1 + lit_len > op_end) {
+		return 0;
+	}
+
+	*op++ = (uint8_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+	if (lit_len >= 15) {
+		op = lz4b_put_length(op, lit_len - 15);
+	}
+	memcpy(op, anchor, lit_len);
+	op += lit_len;
+
+	return (uint32_t)(op - dst);
+}
+
+// Decompress src into dst. Returns the decompressed size, or -1 if the block
+// is malformed or would overflow dst_cap. dict must be the one it was
+// compressed with, or NULL.
+static int32_t
+lz4b_decompress(const uint8_t* src, uint32_t src_len, uint8_t* dst, uint32_t dst_cap,
+		const lz4b_dict* dict)
+{
+	const uint8_t* ip = src;
+	const uint8_t* ip_end = src + src_len;
+	uint8_t* op = dst;
+	uint8_t* op_end = dst + dst_cap;
+	uint32_t dict_len = dict ? dict->len : 0;
+
+	while (ip < ip_end) {
+		uint32_t token = *ip++;
+		uint32_t lit_len = token >> 4;
+		uint32_t match_len = (token & 15) + LZ4B_MIN_MATCH;
+		uint32_t s;
+
+		if (lit_len == 15) {
+			do {
+				if (ip >= ip_end) {
+					return -1;
+				}
+				s = *ip++;
+				lit_len += s;
+			} while (s == 255);
+		}
+
+		if (lit_len > (uint32_t)(ip_end - ip) || lit_len > (uint32_t)(op_end - op)) {
+			return -1;
+		}
+		memcpy(op, ip, lit_len);
+		op += lit_len;
+		ip += lit_len;
+
+		if (ip == ip_end) {
+			break; // the last sequence has literals only
+		}
+		if (ip_end - ip < 2) {
+			return -1;
+		}
+
+		uint32_t offset = ip[0] | ((uint32_t)ip[1] << 8);
+		ip += 2;
+
+		if ((token & 15) == 15) {
+			do {
+				if (ip >= ip_end) {
+					return -1;
+				}
+				s = *ip++;
+				match_len += s;
+			} while (s == 255);
+		}
+
+		uint32_t produced = (uint32_t)(op - dst);
+
+		if (! offset || offset > produced + dict_len || match_len > (uint32_t)(op_end - op)) {
+			return -1;
+		}
+
+		if (offset > produced) {
+			// Starts in the dictionary, and may run on into the output.
+			const uint8_t* match = dict->data + dict_len - (offset - produced);
+			uint32_t from_dict = offset - produced;
+
+			if (from_dict > match_len) {
+				from_dict = match_len;
+			}
+			memcpy(op, match, from_dict);
+			op += from_dict;
+			match_len -= from_dict;
+
+			const uint8_t* out_match = dst;
+
+			while (match_len--) {
+				*op++ = *out_match++;
+			}
+		}
+		else {
+			const uint8_t* match = op - offset;
+
+			if (offset >= match_len) {
+				memcpy(op, match, match_len);
+				op += match_len;
+			}
+			else {
+				while (match_len--) {
+					*op++ = *match++; // overlapping - repeats the last offset bytes
+				}
+			}
+		}
+	}
+
+	return (int32_t)(op - dst);
+}
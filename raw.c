@@ -6,9 +6,16 @@
 //======================================================================================================
 // Includes
 //
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // preadv2/pwritev2
+#endif
+
+#include <dirent.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -16,13 +23,20 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #ifdef linux
 #include <linux/fs.h>
+#include <linux/io_uring.h>
 #endif
 
 #include "clock.h"
+#include "crc32c.h"
+#include "lz4block.h"
+#include "rawstat.h"
 
 //======================================================================================================
 // Constants
@@ -41,16 +55,333 @@
 const uint32_t LO_IO_MIN_SIZE = 512;
 const uint32_t HI_IO_MIN_SIZE = 4096;
 
+// Record handles carry the size class in the top byte and the slot below it.
+#define RECORD_CLASS_SHIFT 56
+#define RECORD_SLOT_MASK ((1ULL << RECORD_CLASS_SHIFT) - 1)
+
+// Slab-style size classes, smallest first. The last one spans a whole large
+// block so multi-sector records have somewhere to go.
+const uint32_t SIZE_CLASS_BYTES[] = { 64, 256, 1024, 4096, 131072 };
+const uint32_t SIZE_CLASS_SHARES[] = { 10, 20, 25, 25, 20 }; // percent
+#define NUM_SIZE_CLASSES (sizeof(SIZE_CLASS_BYTES) / sizeof(SIZE_CLASS_BYTES[0]))
+
+// Bits per chunk of a compressed ref_map - 8K of words when mixed.
+#define REF_MAP_CHUNK_BITS 65536
+
+// Threads are spread over this many placement cursors per bitmap.
+#define PLACEMENT_SHARDS 64
+
+// Most sectors merged into one vectored request (Linux IOV_MAX is 1024).
+#define FLUSH_MAX_IOV 256
+
+// Large blocks a scan keeps in flight ahead of the callback (at most
+// POLL_RING_ENTRIES, so one ring holds all of their reads).
+#define SCAN_READ_AHEAD 4
+
+// How often the gauges in the counters segment are refreshed.
+#define RAWSTAT_PUBLISH_US 100000
+
+// Checksummed sub-sectors start with a header: magic and payload length in
+// the first word, CRC32C of that word and the payload in the second.
+#define SUBSECTOR_MAGIC 0xc5
+#define SUBSECTOR_LEN_MASK 0xffffff
+#define SUBSECTOR_HEADER_BYTES 8
+
+// putRecordJNA records start with a header: flags and stored bytes, original
+// bytes, the dictionary's CRC32C and the original bytes' CRC32C.
+#define RECORD_HEADER_BYTES 16
+#define RECORD_LEN_MASK 0xffffff
+#define RECORD_PACKED 0x80 // written by putRecordJNA
+#define RECORD_LZ4 0x01
+#define RECORD_DICT 0x02
+
+// Polled completions: hybrid spins at most this long before sleeping, and
+// spin time is budgeted per thread over windows of this length.
+#define POLL_HYBRID_MAX_SPIN_NS 50000
+#define POLL_BUDGET_WINDOW_NS 100000000
+#define POLL_RING_ENTRIES 4
+
+// Read-ahead: a thread's reads become a stream after this many steps of the
+// same stride, which is then prefetched a window of sectors ahead. Strides
+// beyond a large block aren't streams.
+#define READAHEAD_TRIGGER 2
+#define READAHEAD_MIN_WINDOW 4
+#define READAHEAD_MAX_WINDOW 64
+#define READAHEAD_MAX_STRIDE 131072
+#define READAHEAD_QUEUE 256
+#define READAHEAD_BATCH 64 // sectors the prefetcher reads in one go
+
 //======================================================================================================
 // Typedefs
 //
+typedef enum {
+	RAW_OK = 0,
+	RAW_ERR_IO = -1,
+	RAW_ERR_NOT_FOUND = -2,
+	RAW_ERR_NO_SPACE = -3,
+	RAW_ERR_ARG = -4,
+	RAW_ERR_CORRUPT = -5 // checksum or header of a sub-sector doesn't verify
+} raw_status;
+
+typedef struct _subsector_header {
+	uint32_t len_flags; // SUBSECTOR_MAGIC << 24 | payload bytes
+	uint32_t crc;
+} subsector_header;
+
+typedef enum {
+	PLACEMENT_FIRST_FIT = 0,
+	PLACEMENT_NEXT_FIT, // per-shard cursor resuming after the last allocation
+	PLACEMENT_ROUND_ROBIN, // each allocation starts in the next large block
+	PLACEMENT_LOCALITY // stay in the sector of the shard's last allocation
+} placement_policy;
+
+typedef struct _place_cursor {
+	uint64_t bit;
+	uint8_t pad[56];
+} __attribute__((aligned(64))) place_cursor;
+
+// Either one dense word array, or (compressed) fixed-size chunks where an
+// all-0 or all-1 chunk holds no words at all and only mixed chunks do.
+typedef struct _ref_map {
+	uint64_t* words;
+	uint64_t** chunks;
+	uint32_t* chunk_set;
+	uint64_t num_chunks;
+	uint64_t num_bits;
+	uint64_t num_set;
+	bool compressed;
+	pthread_mutex_t lock; // compressed layout only
+	place_cursor* cursors; // one per placement shard
+	uint64_t next_block; // round-robin placement
+	uint64_t block_bits; // bits per large block
+	uint64_t sector_bits; // bits per device sector
+} ref_map;
+
+typedef struct _size_class {
+	uint32_t slot_bytes;
+	uint32_t share; // percent of the device given to this class
+	uint64_t base_offset;
+	uint64_t num_slots;
+	ref_map slots;
+	pthread_mutex_t lock; // serializes read-modify-write of shared min-op blocks
+} size_class;
+
+typedef enum {
+	POLL_INTERRUPT = 0, // sleep until the device interrupts
+	POLL_HYBRID, // spin on the completion queue for about the expected latency, then sleep
+	POLL_FULL // kernel polls the device queue (io_uring IOPOLL)
+} poll_mode;
+
+typedef struct _uring {
+	int fd;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_sqe* sqes;
+	struct io_uring_cqe* cqes;
+	void* sq_ring;
+	void* cq_ring;
+	size_t sq_ring_bytes;
+	size_t cq_ring_bytes;
+	size_t sqes_bytes;
+} uring;
+
+typedef struct _poll_thread {
+	uring rings[2]; // interrupt-driven for hybrid, IOPOLL for full
+	int ring_state[2]; // 0 - not set up yet, 1 - ready, -1 - unavailable
+	uint64_t expected_ns[2]; // moving average of completion latency, reads and writes
+	uint64_t window_start_ns;
+	uint64_t window_spin_ns;
+} poll_thread;
+
+typedef struct _record_header {
+	uint32_t len_flags; // RECORD_* flags << 24 | stored bytes
+	uint32_t raw_bytes;
+	uint32_t dict_id; // 0 unless RECORD_DICT
+	uint32_t raw_crc;
+} record_header;
+
+typedef struct _pending_write {
+	uint64_t offset;
+	uint8_t* buffer; // one whole sector
+	uint64_t queued_us;
+} pending_write;
+
+typedef struct _sector_read {
+	uint64_t offset;
+	uint8_t* buffer;
+} sector_read;
+
+// Durable writers queued in the same batch wait on one ticket for its flush
+// to commit. The last waiter to leave frees it.
+typedef struct _flush_ticket {
+	uint32_t waiters;
+	bool done;
+	bool ok;
+} flush_ticket;
+
+// Sector writes waiting to be sorted and merged. 'flushing' holds the batch
+// being written so readers still see it until it reaches the device.
+typedef struct _flush_queue {
+	pthread_mutex_t lock;
+	pthread_mutex_t io_lock; // one flush at a time
+	pthread_cond_t cond;
+	pthread_cond_t committed; // a ticket is done
+	pending_write* entries;
+	pending_write* flushing;
+	flush_ticket* ticket; // for 'entries', NULL until a durable writer joins
+	uint32_t count;
+	uint32_t num_flushing;
+	uint32_t max_pending; // 0 - write through
+	uint32_t deadline_us;
+	bool running;
+	bool failed; // a flush failed since flushJNA or syncJNA last reported
+	pthread_t flusher;
+} flush_queue;
+
+typedef struct _scan_record {
+	uint64_t division;
+	const char* payload; // valid only during the callback
+	uint32_t size;
+} scan_record;
+
+// Return false to stop the scan.
+typedef bool (*scan_callback)(const scan_record* records, uint32_t count, void* udata);
+
+typedef struct _scan_chunk {
+	uint8_t* buffer;
+	uint64_t first_sector;
+	uint32_t num_sectors;
+	bool filled;
+	bool ok;
+} scan_chunk;
+
+// Ring of large-block buffers the reader thread fills ahead of the scan.
+typedef struct _scan_ring {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	scan_chunk chunks[SCAN_READ_AHEAD];
+	uint32_t head; // next chunk the reader fills
+	uint32_t tail; // next chunk the scan consumes
+	bool done; // reader reached the end
+	bool stop; // scan ended early
+} scan_ring;
+
+typedef enum {
+	QOS_READ = 0, // foreground reads never queue
+	QOS_WRITE,
+	QOS_BACKGROUND, // flushes and scans
+	QOS_NUM_CLASSES
+} qos_class;
+
+// Tokens may go negative; a caller in debt sleeps until it is paid back.
+typedef struct _token_bucket {
+	uint64_t rate; // tokens per second, 0 - unlimited
+	int64_t burst;
+	int64_t tokens;
+	uint64_t last_ns;
+} token_bucket;
+
+// Writes and background work share 'depth' device slots. While reads are
+// in flight the non-read classes only get their weighted share of them.
+typedef struct _qos_sched {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint32_t depth; // 0 - scheduler off
+	uint32_t weights[QOS_NUM_CLASSES];
+	uint32_t inflight[QOS_NUM_CLASSES];
+	uint32_t waiting[QOS_NUM_CLASSES];
+	uint64_t vtime[QOS_NUM_CLASSES]; // weighted service received
+	token_bucket write_bytes;
+	token_bucket write_iops;
+} qos_sched;
+
+typedef enum {
+	DURABILITY_NONE = 0, // acknowledged once in the drive's (maybe volatile) cache
+	DURABILITY_FUA, // every write goes out with RWF_DSYNC
+	DURABILITY_GROUP // writers wait for a cache flush they share
+} durability_mode;
+
+// Group commit. Device writes take sequence numbers as they finish; one
+// writer at a time leads a flush covering every write numbered so far,
+// and the others wait for the flush that covers theirs.
+typedef struct _group_commit {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint32_t mode;
+	uint32_t window_us; // a leader waits this long for others to join
+	uint64_t write_seq;
+	uint64_t synced_seq; // covered by a finished flush, good or not
+	uint64_t durable_seq; // covered by a good flush
+	uint64_t failed_seq; // highest write covered by a failed flush
+	bool syncing;
+} group_commit;
+
+typedef enum {
+	RA_EMPTY = 0,
+	RA_LOADING,
+	RA_READY
+} ra_state;
+
+// One sector of the read-ahead pool. A loading slot belongs to the
+// prefetcher; 'seq' moves on when the slot is reclaimed or its sector is
+// written, so a load that went stale meanwhile is thrown away.
+typedef struct _ra_slot {
+	uint64_t offset;
+	uint64_t seq;
+	uint8_t* buffer;
+	uint32_t state;
+	bool used; // read since it was loaded
+} ra_slot;
+
+typedef struct _ra_request {
+	uint32_t slot;
+	uint64_t seq;
+} ra_request;
+
+// Prefetched sectors, direct-mapped by offset so the pool's memory is
+// fixed. A new prefetch replaces whatever ready sector held its slot.
+typedef struct _readahead_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond; // requests queued
+	pthread_cond_t loaded; // a slot finished loading
+	ra_slot* slots;
+	uint32_t num_slots; // 0 - read-ahead off
+	uint32_t min_window;
+	uint32_t max_window;
+	ra_request queue[READAHEAD_QUEUE];
+	uint32_t queue_head;
+	uint32_t queue_count;
+	uint32_t generation; // bumped by setReadAheadJNA, restarts the streams
+	bool running;
+	pthread_t prefetcher;
+} readahead_pool;
+
+// A thread's read stream. The window grows while prefetched sectors are
+// read and shrinks when they are not there in time.
+typedef struct _ra_stream {
+	uint32_t generation;
+	uint64_t last_offset;
+	int64_t stride;
+	uint32_t run; // steps that kept the stride
+	uint32_t window; // sectors kept ahead, 0 - not streaming
+	uint64_t frontier; // next offset to prefetch
+	uint32_t hits;
+	uint32_t misses;
+} ra_stream;
+
 typedef struct _device {
 	const char* name;
-	uint64_t* ref_tab;
+	ref_map ref_tab;
 	uint64_t num_large_blocks;
 	uint64_t num_read_offsets;
 	uint32_t min_op_bytes;
 	uint32_t read_bytes;
+	size_class* classes;
+	uint32_t num_classes;
 } device;
 
 const char* const SCHEDULER_MODES[] = {
@@ -85,6 +416,55 @@ static char g_device_name[MAX_DEVICE_NAME_SIZE];
 static uint32_t g_scheduler_mode = 0; //noop mode
 static uint32_t g_record_bytes = 512; 
 static uint32_t g_large_block_ops_bytes = 131072; //128K
+static bool g_ref_map_compressed = false;
+static bool g_checksums = false;
+static pthread_once_t g_crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t g_placement_policy = PLACEMENT_FIRST_FIT;
+static uint32_t g_next_shard = 0;
+static __thread uint32_t t_shard = PLACEMENT_SHARDS; // not assigned yet
+static rawstat_segment* g_stats = NULL;
+static pthread_once_t g_stats_once = PTHREAD_ONCE_INIT;
+static char g_stats_shm_name[64];
+static pthread_key_t g_stats_key;
+static pthread_mutex_t g_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t g_stats_free[RAWSTAT_MAX_THREADS]; // slots of exited threads
+static uint32_t g_stats_num_free = 0;
+static __thread rawstat_thread* t_stats = NULL;
+static __thread char* t_message = NULL;
+static __thread uint32_t t_message_bytes = 0;
+static bool g_codec = false;
+static lz4b_dict* g_codec_dict = NULL;
+static uint32_t g_codec_dict_id = 0;
+static __thread uint8_t* t_codec = NULL;
+static __thread uint32_t t_codec_bytes = 0;
+static uint32_t g_poll_mode = POLL_INTERRUPT;
+static uint32_t g_poll_budget_pct = 100; // of one core, per thread
+static bool g_iopoll_unsupported = false;
+static pthread_key_t g_poll_key;
+static pthread_once_t g_poll_once = PTHREAD_ONCE_INIT;
+static __thread poll_thread* t_poll = NULL;
+static __thread ra_stream t_stream;
+static qos_sched g_qos = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.weights = { 8, 2, 1 }
+};
+static flush_queue g_flush = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.io_lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.committed = PTHREAD_COND_INITIALIZER
+};
+static group_commit g_commit = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.mode = DURABILITY_NONE
+};
+static readahead_pool g_readahead = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.loaded = PTHREAD_COND_INITIALIZER
+};
 //static uint64_t* g_positions;
 
 static device* g_device;
@@ -113,12 +493,26 @@ static inline uint8_t* cf_valloc(size_t size);
 static void	set_scheduler();
 //static void print_ref_tab(); 
 static void erase_sector_ref(uint64_t sector, uint32_t div); 
-static void add_sector_ref(uint64_t sector, uint32_t div); 
+static bool add_sector_ref(uint64_t sector, uint32_t div);
 static void prep_to_sector_div(uint64_t offset, uint32_t division, void* dest, char* message, uint32_t write_size); 
 //static bool show_sector_ref(uint64_t offset, uint32_t division);
 static uint64_t discover_min_op_bytes(int fd, const char *name);
 //static void getAvailableSubsector(uint64_t size, long positions[]);
 static bool is_sector_free(uint64_t sector, uint32_t div); 
+static bool ref_map_init(ref_map* map, uint64_t num_bits, bool compressed);
+static inline bool ref_map_test(ref_map* map, uint64_t bit);
+static inline bool ref_map_set(ref_map* map, uint64_t bit);
+static inline bool ref_map_clear(ref_map* map, uint64_t bit);
+static uint64_t ref_map_next_free(ref_map* map, uint64_t from);
+static uint64_t ref_map_bytes(const ref_map* map);
+static uint64_t ref_map_next_set(ref_map* map, uint64_t from);
+static bool ref_map_claim(ref_map* map, uint64_t* p_bit);
+static uint64_t ref_map_place_start(ref_map* map);
+static void ref_map_placed(ref_map* map, uint64_t bit);
+static void ref_map_set_geometry(ref_map* map, uint64_t block_bits, uint64_t sector_bits);
+static bool create_ref_tab(device* p_device);
+static bool create_size_classes(device* p_device);
+static int32_t record_io(size_class* cls, uint64_t slot, char* buffer, uint32_t size, bool write);
 static bool	configure(int argc, char* argv[]);
 static bool config_is_arg_num(char *argv);
 static bool config_parse_device_name(char* device);
@@ -127,12 +521,84 @@ static bool read_from_device(device* p_device, uint64_t offset,
 					uint32_t size, void* p_buffer);
 static bool write_to_device(device* p_device, uint64_t offset,
 					uint32_t size, void* p_buffer);
+static bool read_vec_from_device(device* p_device, uint64_t offset,
+					const struct iovec* iov, int iov_count, uint64_t size);
+static bool write_vec_to_device(device* p_device, uint64_t offset,
+					const struct iovec* iov, int iov_count, uint64_t size);
+static void patch_sector_div(void* dest, uint32_t division, char* message, uint32_t write_size);
+static void seal_sector_div(uint8_t* div, uint32_t sector_div, const char* message, uint32_t write_size);
+static raw_status open_sector_div(const uint8_t* div, uint32_t sector_div, const uint8_t** payload, uint32_t* len);
+static bool read_sector(uint64_t offset, void* p_buffer);
+static bool read_sector_pending(uint64_t offset, void* p_buffer);
+static bool read_sectors(const uint64_t* offsets, uint32_t count, uint8_t** buffers);
+static bool flush_enqueue(uint64_t offset, uint32_t division, char* message, uint32_t write_size);
+static bool flush_pending();
+static bool flush_all();
+static void *flusher_op(void *arg);
+static bool qos_begin(qos_class cls, uint64_t bytes, bool write);
+static void qos_end(qos_class cls, bool admitted);
+static uint64_t token_bucket_take(token_bucket* tb, uint64_t amount, uint64_t now_ns);
+static void token_bucket_config(token_bucket* tb, uint64_t rate, uint64_t burst);
+static void *scan_reader_op(void *arg);
+static void *stats_publisher_op(void *arg);
+static void stats_init();
+static void stats_publish();
+static void stats_unlink();
+static void stats_unlink_stale();
+static inline rawstat_thread* thread_stats();
+static rawstat_thread* thread_stats_slot();
+static void thread_stats_free(void* arg);
+static inline uint64_t stats_op_begin();
+static inline void stats_op_end(rawstat_op op, uint64_t start_ticks, uint64_t bytes, bool ok);
+static char* thread_message(uint32_t size);
+static uint8_t* codec_scratch(uint32_t size);
+static bool poll_rw(int fd, uint64_t offset, uint32_t size, void* p_buffer, bool write, ssize_t* result);
+static poll_thread* thread_poll();
+static void poll_thread_free(void* arg);
+static void poll_key_init();
+static bool uring_init(uring* ring, bool iopoll);
+static void uring_free(uring* ring);
+static bool uring_submit(uring* ring, int fd, uint64_t offset, uint32_t size, void* p_buffer, bool write, int rw_flags, bool wait);
+static struct io_uring_cqe* uring_peek(uring* ring);
+static inline int durability_rw_flags();
+static bool durability_commit();
+static bool read_sector_ahead(uint64_t offset, void* p_buffer);
+static bool readahead_lookup(uint64_t offset, void* p_buffer);
+static void readahead_access(uint64_t offset, bool hit);
+static void readahead_request(ra_stream* st, uint64_t offset);
+static void readahead_invalidate(uint64_t offset, uint64_t size);
+static void *prefetcher_op(void *arg);
+static uint32_t record_pack(const char* message, uint32_t size, uint8_t* p_record);
+static int32_t record_unpack(const uint8_t* p_record, uint32_t slot_bytes, char* dest, uint32_t dest_size);
 
 char* readJNA(uint64_t division, uint32_t read_size);
+int32_t readIntoJNA(uint64_t division, char* dest, uint32_t read_size);
 bool writeJNA(uint64_t division, char* message, uint32_t write_size);
 bool configJNA(char* device_name, uint32_t size, uint32_t num_of_sub_sector);
 void getAvailableSubsectorJNA(uint64_t size, long positions[]);
 void eraseSubsectorJNA(uint64_t division);
+bool configSizeClassesJNA(char* device_name);
+int64_t allocRecordJNA(uint32_t size);
+void setCompressedRefTabJNA(bool compressed);
+bool setPlacementPolicyJNA(uint32_t policy);
+int32_t writeRecordJNA(uint64_t record, char* message, uint32_t write_size);
+int32_t readRecordJNA(uint64_t record, char* dest, uint32_t read_size);
+void freeRecordJNA(uint64_t record);
+bool setWriteBatchingJNA(uint32_t max_pending, uint32_t deadline_us);
+bool flushJNA();
+int32_t readBatchJNA(uint64_t divisions[], uint32_t count, uint32_t read_size, char* dest);
+int64_t scanJNA(scan_callback callback, void* udata, uint32_t batch_size);
+bool statsJNA(rawstat_snapshot* snapshot);
+bool setQosJNA(uint32_t depth, uint32_t read_weight, uint32_t write_weight, uint32_t background_weight);
+void setWriteLimitsJNA(uint64_t bytes_per_sec, uint64_t iops);
+void setChecksumsJNA(bool enabled);
+bool setCompressionJNA(bool enabled, char* dict, uint32_t dict_size);
+int64_t putRecordJNA(char* message, uint32_t size);
+int32_t getRecordJNA(uint64_t record, char* dest, uint32_t dest_size);
+bool setPollModeJNA(uint32_t mode, uint32_t cpu_budget_pct);
+bool setDurabilityJNA(uint32_t mode, uint32_t group_window_us);
+bool syncJNA();
+bool setReadAheadJNA(uint32_t max_sectors);
 
 //======================================================================================================
 // Main
@@ -145,7 +611,7 @@ void eraseSubsectorJNA(uint64_t division);
 // 		}
 
 // 		//free(g_positions);
-// 		free(g_device->ref_tab);
+// 		free(g_device->ref_tab.words);
 // 		free(g_device);
 // 	}else
 // 	{printf("Wrong number of arguments! \n");}
@@ -205,7 +671,7 @@ void eraseSubsectorJNA(uint64_t division);
 // 	printf("\n=> Raw Device Access - direct IO Stress test Ends\n");
 	
 // 	fclose(g_output_file);
-// 	free(g_device->ref_tab);
+// 	free(g_device->ref_tab.words);
 // 	free(g_device);
 // }
 
@@ -219,11 +685,14 @@ void eraseSubsectorJNA(uint64_t division);
 char* readJNA(uint64_t division, uint32_t read_size){
 		
 	int sector_div = g_device->read_bytes/g_ref_tab_columns;
-	char* message = cf_valloc(sector_div);
+	uint64_t start_ticks = stats_op_begin();
+	char* message = thread_message(sector_div);
 	void* p_buffer = cf_valloc(g_device->read_bytes);
 
-	if (! p_buffer) {
+	if (! (p_buffer && message)) {
 		printf("=> ERROR: read buffer cf_valloc()\n");
+		free(p_buffer);
+		stats_op_end(RAWSTAT_OP_READ, start_ticks, 0, false);
 		return NULL;
 	}
 
@@ -231,39 +700,111 @@ char* readJNA(uint64_t division, uint32_t read_size){
 	offset = (offset % g_device->num_read_offsets) * g_device->min_op_bytes;
 
 	if(! is_sector_free(offset/g_device->read_bytes, division % g_ref_tab_columns)){
-		if (! read_from_device(g_device, offset, g_device->read_bytes, p_buffer)){
+		bool admitted = qos_begin(QOS_READ, g_device->read_bytes, false);
+		bool ok = read_sector_ahead(offset, p_buffer);
+		qos_end(QOS_READ, admitted);
+
+		if (! ok){
 				printf("=> ERROR read op on offset: %" PRIu64 "\n", offset);
 				free(p_buffer);
-				free(message);
+				stats_op_end(RAWSTAT_OP_READ, start_ticks, 0, false);
 				return NULL;
 		}else{
-			memset(message, '\0', sizeof(message));
-			if (read_size > 0 && read_size < sector_div){
-				strncpy(message, p_buffer+(sector_div*(division % g_ref_tab_columns)), read_size);
-			}else if(read_size >= sector_div){
-				strncpy(message, p_buffer+(sector_div*(division % g_ref_tab_columns)), sector_div-1);
+			const uint8_t* payload;
+			uint32_t len;
+
+			if (open_sector_div(p_buffer+(sector_div*(division % g_ref_tab_columns)), sector_div,
+					&payload, &len) != RAW_OK){
+				free(p_buffer);
+				stats_op_end(RAWSTAT_OP_READ, start_ticks, 0, false);
+				return NULL;
+			}
+
+			memset(message, '\0', sector_div);
+			if (len > sector_div - 1){
+				len = sector_div - 1;
 			}
-			// printf("readSize = %"PRIu32"\n", read_size);
-			printf("Message = %s\n", message);
+			strncpy(message, (const char*)payload, read_size < len ? read_size : len);
+			stats_op_end(RAWSTAT_OP_READ, start_ticks, g_device->read_bytes, true);
 		}
 	}else{
-		printf("=> Sector NOT referenced!\n");
+		thread_stats()->not_found++;
+		stats_op_end(RAWSTAT_OP_READ, start_ticks, 0, true);
+		message = NULL;
 	}
 
 	free(p_buffer);
-	free(message);
 	return message;
 }
 
+//------------------------------------------------
+// Read a sub_sector into caller memory for JNA (off-heap, binary safe)
+//
+int32_t readIntoJNA(uint64_t division, char* dest, uint32_t read_size){
+	uint32_t sector_div = g_device->read_bytes/g_ref_tab_columns;
+	uint64_t offset = division / g_ref_tab_columns;
+	offset = (offset % g_device->num_read_offsets) * g_device->min_op_bytes;
+
+	if (! dest) {
+		return RAW_ERR_ARG;
+	}
+
+	if (is_sector_free(offset/g_device->read_bytes, division % g_ref_tab_columns)) {
+		thread_stats()->not_found++;
+		return RAW_ERR_NOT_FOUND;
+	}
+
+	uint64_t start_ticks = stats_op_begin();
+	void* p_buffer = cf_valloc(g_device->read_bytes);
+
+	if (! p_buffer) {
+		printf("=> ERROR: read buffer cf_valloc()\n");
+		stats_op_end(RAWSTAT_OP_READ, start_ticks, 0, false);
+		return RAW_ERR_IO;
+	}
+
+	bool admitted = qos_begin(QOS_READ, g_device->read_bytes, false);
+	bool ok = read_sector_ahead(offset, p_buffer);
+	qos_end(QOS_READ, admitted);
+
+	if (! ok) {
+		printf("=> ERROR read op on offset: %" PRIu64 "\n", offset);
+		free(p_buffer);
+		stats_op_end(RAWSTAT_OP_READ, start_ticks, 0, false);
+		return RAW_ERR_IO;
+	}
+
+	const uint8_t* payload;
+	uint32_t len;
+
+	if (open_sector_div((uint8_t*)p_buffer + sector_div * (division % g_ref_tab_columns), sector_div,
+			&payload, &len) != RAW_OK) {
+		free(p_buffer);
+		stats_op_end(RAWSTAT_OP_READ, start_ticks, 0, false);
+		return RAW_ERR_CORRUPT;
+	}
+
+	if (read_size > len) {
+		read_size = len;
+	}
+	memcpy(dest, payload, read_size);
+
+	free(p_buffer);
+	stats_op_end(RAWSTAT_OP_READ, start_ticks, g_device->read_bytes, true);
+	return (int32_t)read_size;
+}
+
 //------------------------------------------------
 // Write to sub_sectors function for JNA 
 //
 bool writeJNA(uint64_t division, char* message, uint32_t write_size){
 
+	uint64_t start_ticks = stats_op_begin();
 	void *p_buffer = cf_valloc(g_device->read_bytes);
 
 	if (! p_buffer) {
 		printf("=> ERROR: read buffer cf_valloc()\n");
+		stats_op_end(RAWSTAT_OP_WRITE, start_ticks, 0, false);
 		return false;
 	}
 
@@ -271,19 +812,52 @@ bool writeJNA(uint64_t division, char* message, uint32_t write_size){
 	offset = (offset % g_device->num_read_offsets) * g_device->min_op_bytes;
 
 	if(is_sector_free(offset/g_device->read_bytes, division % g_ref_tab_columns)){
+		if (g_flush.max_pending){
+			// Batched: the scheduler owns the sector buffer from here on.
+			if (! flush_enqueue(offset, division % g_ref_tab_columns, message, write_size)){
+				printf("=> ERROR queueing write on offset: %" PRIu64 "\n", offset);
+				free(p_buffer);
+				stats_op_end(RAWSTAT_OP_WRITE, start_ticks, 0, false);
+				return false;
+			}
+			// Unreferenced, the queued copy is never read back - fail the write.
+			if (! add_sector_ref(offset/g_device->read_bytes, division % g_ref_tab_columns)){
+				printf("=> ERROR referencing offset: %" PRIu64 "\n", offset);
+				free(p_buffer);
+				stats_op_end(RAWSTAT_OP_WRITE, start_ticks, 0, false);
+				return false;
+			}
+			free(p_buffer);
+			stats_op_end(RAWSTAT_OP_WRITE, start_ticks, 0, true); // device bytes count at flush
+			return true;
+		}
+
+		bool admitted = qos_begin(QOS_WRITE, g_device->read_bytes, true);
 		prep_to_sector_div(offset, division % g_ref_tab_columns, p_buffer, message, write_size);
-		if (! write_to_device(g_device, offset, g_device->read_bytes, p_buffer)){
+		bool ok = write_to_device(g_device, offset, g_device->read_bytes, p_buffer);
+		qos_end(QOS_WRITE, admitted);
+		ok = ok && durability_commit();
+
+		if (! ok){
 				printf("=> ERROR write op on offset: %" PRIu64 "\n", offset);
 				free(p_buffer);
+				stats_op_end(RAWSTAT_OP_WRITE, start_ticks, 0, false);
 				return false;
-		}else{
-			add_sector_ref(offset/g_device->read_bytes, division % g_ref_tab_columns);
+		}else if (! add_sector_ref(offset/g_device->read_bytes, division % g_ref_tab_columns)){
+			printf("=> ERROR referencing offset: %" PRIu64 "\n", offset);
+			free(p_buffer);
+			stats_op_end(RAWSTAT_OP_WRITE, start_ticks, 0, false);
+			return false;
 		}
 	}else{
-		printf("=> Sector ALREADY referenced!\n");
+		thread_stats()->conflicts++;
+		stats_op_end(RAWSTAT_OP_WRITE, start_ticks, 0, true);
+		free(p_buffer);
+		return true;
 	}
 	
 	free(p_buffer);
+	stats_op_end(RAWSTAT_OP_WRITE, start_ticks, g_device->read_bytes, true);
 	return true;
 }
 
@@ -292,11 +866,13 @@ bool writeJNA(uint64_t division, char* message, uint32_t write_size){
 //
 void eraseSubsectorJNA(uint64_t division){
 
+	uint64_t start_ticks = stats_op_begin();
 	uint64_t offset = division / g_ref_tab_columns;
 	offset = (offset % g_device->num_read_offsets) * g_device->min_op_bytes;
 
 	erase_sector_ref(offset/g_device->read_bytes, division % g_ref_tab_columns);
 
+	stats_op_end(RAWSTAT_OP_ERASE, start_ticks, 0, true);
 }
 
 //------------------------------------------------
@@ -316,6 +892,11 @@ bool configJNA(char* device_name, uint32_t size, uint32_t num_of_sub_sector){
 		return false;
 	}
 
+	if (! create_ref_tab(g_device)){
+		printf("=> ERROR: Couldn't create table of reference.\n");
+		return false;
+	}
+
 	set_scheduler();
 
 	return true;
@@ -327,202 +908,2498 @@ bool configJNA(char* device_name, uint32_t size, uint32_t num_of_sub_sector){
 void getAvailableSubsectorJNA(uint64_t size, long positions[]){
 	//getAvailableSubsector(size, positions);
 	 uint16_t sub_sector_size = g_device->read_bytes/g_ref_tab_columns;
-	 uint64_t i, count=0, max = size % sub_sector_size == 0 || size!=0 ? size/sub_sector_size : size/sub_sector_size+1;
+	 uint64_t count=0, max = size % sub_sector_size == 0 || size!=0 ? size/sub_sector_size : size/sub_sector_size+1;
+	 ref_map* map = &g_device->ref_tab;
+	 uint64_t start = ref_map_place_start(map), bit = start;
+	 bool wrapped = false;
 
-	for (i=0;i< (g_ref_tab_columns*g_device->num_read_offsets)/(sizeof(uint64_t)*8); i++){
-		uint8_t j;
-		for (j=0; j<64; j++){
-			if( !(*(g_device->ref_tab + i) & ((uint64_t)0b1 << j)) ){
-				positions[count] = (i*64)+j;
-				count++;
+	// Scan from the policy's starting point, wrapping once to the front.
+	while (count < max){
+		bit = ref_map_next_free(map, bit);
 
-				if (count >= max){return;}
-			}		
+		if (wrapped && bit >= start){
+			break;
+		}
+		if (bit >= map->num_bits){
+			if (wrapped || start == 0){
+				break;
+			}
+			wrapped = true;
+			bit = 0;
+			continue;
 		}
+
+		positions[count] = bit;
+		count++;
+		bit++;
+	}
+
+	if (count){
+		ref_map_placed(map, positions[count - 1]);
 	}
 }
 
 //------------------------------------------------
-// Get one or more available sub-sectors for JNA 
+// Choose where new sub-sectors and records are placed for JNA
 //
-// static char* myStrncpy(char *s1, const char *s2, size_t n, char c){
+bool setPlacementPolicyJNA(uint32_t policy){
+	if (policy > PLACEMENT_LOCALITY){
+		return false;
+	}
 
-// 	char *s = s1;
-// 	while (n > 0 && *s2 != '\0') {
-// 		*s++ = *s2++;
-// 		--n;
-//     }
-//     while (n > 0) {
-//     	if (n > 2)
-//     	{*s++ = c;}
-//     	else
-// 		{*s++ = '\0';}
-// 		--n;
-//     }
-// }
+	g_placement_policy = policy;
+	return true;
+}
 
-//======================================================================================================
-// Threads
+//------------------------------------------------
+// Config with size classes for JNA
 //
+bool configSizeClassesJNA(char* device_name){
+	if (! config_parse_device_name(device_name)){
+		printf("=> ERROR: Couldn't parse device name: %s\n", device_name);
+		return false;
+	}
+
+	if (! discover_num_blocks(g_device)){
+		printf("=> ERROR: Couldn't discover number of blocks.\n");
+		return false;
+	}
+
+	if (! create_size_classes(g_device)){
+		printf("=> ERROR: Couldn't create size classes.\n");
+		return false;
+	}
+
+	set_scheduler();
+
+	return true;
+}
 
 //------------------------------------------------
-// Thread Creation Operation.
+// Choose the bitmap layout for JNA (before configJNA/configSizeClassesJNA)
 //
-// static bool thread_creation_op(int num_of_threads){
-// 	int i;
-// 	pthread_t threads[num_of_threads];
+void setCompressedRefTabJNA(bool compressed){
+	g_ref_map_compressed = compressed;
+}
 
-// 	if (num_of_threads < 0 || num_of_threads > THREADS_MAX_NUM){
-// 		printf("=> ERROR: invalid number of threads!\n");
-// 		return false;
-// 	}
-	
-// 	// for (i=0; i < (num_of_threads); i++){
-// 	// 	int *thread_num = malloc(sizeof(int *));
-// 	// 	*thread_num = (int)g_running_threads;
+//------------------------------------------------
+// Allocate a record slot in the best-fitting size class for JNA
+//
+int64_t allocRecordJNA(uint32_t size){
+	uint32_t c;
 
-// 	// 	//READ ONLY
-// 	// 	pthread_create(&(threads[i]), NULL, read_op, thread_num);
+	if (size == 0) {
+		return RAW_ERR_ARG;
+	}
 
-// 	// 	pthread_mutex_lock(&running_mutex);
-// 	// 	g_read_threads++;
-//  //    	g_running_threads++;
-//  //    	pthread_mutex_unlock(&running_mutex);
+	// Smallest class that fits first, spilling into larger ones when full.
+	for (c = 0; c < g_device->num_classes; c++){
+		size_class* cls = &g_device->classes[c];
+		uint64_t slot;
 
-//  //    	//WRITE ONLY
-//  //    	pthread_create(&(threads[i]), NULL, write_op, thread_num);
+		if (cls->slot_bytes >= size && ref_map_claim(&cls->slots, &slot)){
+			return (int64_t)(((uint64_t)c << RECORD_CLASS_SHIFT) | slot);
+		}
+	}
 
-// 	// 	pthread_mutex_lock(&running_mutex);
-// 	// 	g_write_threads++;
-//  //    	g_running_threads++;
-//  //    	pthread_mutex_unlock(&running_mutex);
-// 	// }
-	
-// 	// READ AND WRITE
-// 	for (i=0; i < (num_of_threads*3)/4; i++){
-// 		int *thread_num = malloc(sizeof(int *));
-// 		*thread_num = (int)g_running_threads;
-// 		pthread_create(&(threads[i]), NULL, read_op, thread_num);
+	return RAW_ERR_NO_SPACE;
+}
 
-// 		pthread_mutex_lock(&running_mutex);
-// 		g_read_threads++;
-//     	g_running_threads++;
-//     	pthread_mutex_unlock(&running_mutex);
+//------------------------------------------------
+// Write a record to its slot for JNA
+//
+int32_t writeRecordJNA(uint64_t record, char* message, uint32_t write_size){
+	uint32_t c = (uint32_t)(record >> RECORD_CLASS_SHIFT);
+	uint64_t slot = record & RECORD_SLOT_MASK;
 
-// 	}
-// 	for (i= (num_of_threads*3)/4; i < num_of_threads; i++){
-// 		int *thread_num = malloc(sizeof(int *));
-// 		*thread_num = (int)g_running_threads;
-// 		pthread_create(&(threads[i]), NULL, write_op, thread_num);
+	if (c >= g_device->num_classes || slot >= g_device->classes[c].num_slots ||
+			write_size > g_device->classes[c].slot_bytes) {
+		return RAW_ERR_ARG;
+	}
 
-// 		pthread_mutex_lock(&running_mutex);
-// 		g_write_threads++;
-//     	g_running_threads++;
-//     	pthread_mutex_unlock(&running_mutex);
-// 	}
+	if (! ref_map_test(&g_device->classes[c].slots, slot)) {
+		return RAW_ERR_NOT_FOUND;
+	}
 
-// 	return true;
-// }
+	uint64_t start_ticks = stats_op_begin();
+	int32_t result = record_io(&g_device->classes[c], slot, message, write_size, true);
+
+	stats_op_end(RAWSTAT_OP_WRITE, start_ticks, g_device->classes[c].slot_bytes, result >= 0);
+	return result;
+}
 
 //------------------------------------------------
-// Thread Read Operation.
+// Read a record from its slot for JNA. Slots don't store the written
+// length: this returns min(read_size, slot size), zero padded past what
+// was written. Use putRecordJNA/getRecordJNA to get the length back.
 //
-// static void *read_op(void *thread_num){
-// 	int counter = 0;	
-// 	uint64_t begin_op_time, offset;
-// 	void* p_buffer = cf_valloc(g_device->read_bytes);
+int32_t readRecordJNA(uint64_t record, char* dest, uint32_t read_size){
+	uint32_t c = (uint32_t)(record >> RECORD_CLASS_SHIFT);
+	uint64_t slot = record & RECORD_SLOT_MASK;
 
-// 	if (! p_buffer) {
-// 		printf("=> ERROR: read buffer cf_valloc()\n");
-// 		return NULL;
-// 	}
+	if (c >= g_device->num_classes || slot >= g_device->classes[c].num_slots) {
+		return RAW_ERR_ARG;
+	}
 
-// 	while (g_running){
-// 		offset = random_read_offset(g_device);
-// 		begin_op_time = cf_getus();
-// 		if (! read_from_device(g_device, offset, g_device->read_bytes, p_buffer)){
-// 			printf("=> ERROR read op number: %d; Offset: %" PRIu64 "\n", counter+1, offset);
-// 		}
-// 		else{
-// 			array_add(safe_delta_ns(begin_op_time, cf_getus())/10);
-// 			counter++;
-// 		}
-// 	}
+	if (! ref_map_test(&g_device->classes[c].slots, slot)) {
+		thread_stats()->not_found++;
+		return RAW_ERR_NOT_FOUND;
+	}
 
-// 	pthread_mutex_lock(&running_mutex);
-// 	g_reads_counter += counter;
-// 	g_running_threads--;
-// 	pthread_mutex_unlock(&running_mutex);
+	uint64_t start_ticks = stats_op_begin();
+	int32_t result = record_io(&g_device->classes[c], slot, dest, read_size, false);
 
-	
+	stats_op_end(RAWSTAT_OP_READ, start_ticks, g_device->classes[c].slot_bytes, result >= 0);
+	return result;
+}
 
-//    	free(p_buffer);
-//    	free(thread_num);
-//    	return NULL;
-// }
+//------------------------------------------------
+// Release a record slot for JNA
+//
+void freeRecordJNA(uint64_t record){
+	uint32_t c = (uint32_t)(record >> RECORD_CLASS_SHIFT);
+	uint64_t slot = record & RECORD_SLOT_MASK;
+
+	if (c < g_device->num_classes && slot < g_device->classes[c].num_slots) {
+		ref_map_clear(&g_device->classes[c].slots, slot);
+	}
+}
 
 //------------------------------------------------
-// Thread Write Operation.
+// Batch sector writes for JNA (max_pending 0 writes through again). With
+// deadline_us 0 there is no flusher: the queue goes out when it fills, or
+// on flushJNA/syncJNA.
 //
-// static void *write_op(void *thread_num){
-// 	int counter = 0;
-// 	uint64_t begin_op_time, offset;
-// 	char* message = "Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Regards, thread";
-// 	void* p_buffer = cf_valloc(g_device->read_bytes);
+bool setWriteBatchingJNA(uint32_t max_pending, uint32_t deadline_us){
+	pthread_mutex_lock(&g_flush.lock);
+	bool had_flusher = g_flush.running;
+	g_flush.running = false;
+	pthread_cond_signal(&g_flush.cond);
+	pthread_mutex_unlock(&g_flush.lock);
+
+	if (had_flusher) {
+		pthread_join(g_flush.flusher, NULL);
+	}
 
-// 	if (! p_buffer) {
-// 		printf("=> ERROR: write buffer cf_valloc()\n");
-// 		return NULL;
-// 	}
+	// Whatever was queued under the old settings goes out first.
+	bool ok = flush_all();
 
-// 	//strcpy(p_buffer, message);
+	free(g_flush.entries);
+	free(g_flush.flushing);
+	g_flush.entries = NULL;
+	g_flush.flushing = NULL;
+	g_flush.max_pending = 0;
 
-// 	while (g_running){
-// 		offset = random_read_offset(g_device);
-// 		int division = rand()%g_ref_tab_columns;
-// 		if (is_sector_free(offset/g_device->read_bytes, division)){
-// 			prep_to_sector_div(offset, division , p_buffer, message, strlen(message));
-// 			begin_op_time = cf_getus();
-// 			if (! write_to_device(g_device, offset, g_device->read_bytes, p_buffer)){
-// 				printf("=> ERROR write op number: %d; Offset: %" PRIu64 "\n", counter+1, offset);
-// 			}
-// 			else{
-// 				array_add(safe_delta_ns(begin_op_time, cf_getus())/10);
-// 				add_sector_ref(offset/g_device->read_bytes, division);
-// 				counter++;
-// 			}
-// 		}
-// 	}
+	if (! max_pending) {
+		return ok;
+	}
 
-// 	pthread_mutex_lock(&running_mutex);
-// 	g_writes_counter += counter;
-// 	g_running_threads--;
-// 	pthread_mutex_unlock(&running_mutex);
+	g_flush.entries = calloc(max_pending, sizeof(pending_write));
+	g_flush.flushing = calloc(max_pending, sizeof(pending_write));
 
-//    	free(p_buffer);
-//    	free(thread_num);
-//    	return NULL;
-// }
+	if (! (g_flush.entries && g_flush.flushing)) {
+		printf("=> ERROR: flush queue calloc()\n");
+		return false;
+	}
 
-//======================================================================================================
-// Helpers
+	g_flush.deadline_us = deadline_us;
+	g_flush.max_pending = max_pending;
+
+	if (deadline_us) {
+		g_flush.running = true;
+		if (pthread_create(&g_flush.flusher, NULL, flusher_op, NULL) != 0) {
+			printf("=> ERROR: couldn't start flusher thread\n");
+			g_flush.running = false;
+			return false;
+		}
+	}
+
+	return ok;
+}
+
+//------------------------------------------------
+// Write out every batched sector now for JNA. Also returns false if an
+// earlier flush - a full queue's or the flusher's - failed since the last
+// flushJNA or syncJNA.
 //
+bool flushJNA(){
+	return flush_all();
+}
 
 //------------------------------------------------
-// Print information from the test
+// Read many sub_sectors with merged device reads for JNA
 //
-// static void print_final_info(uint64_t main_total_time){
-// 	fprintf(g_output_file, "__________________________________________\n");
-// 	fprintf(g_output_file, "Total time: %" PRIu64 " s\n", main_total_time/1000000);
-// 	fprintf(g_output_file, "Total threads created: %d\n", g_read_threads + g_write_threads);
-// 	fprintf(g_output_file, "Number of reads threads: %" PRIu64 "\n", g_read_threads);
-// 	fprintf(g_output_file, "Number of reads counter: %" PRIu64 "\n", g_reads_counter);
-// 	if(g_read_threads != 0)
-// 	{fprintf(g_output_file, "Average reads operations counter: %" PRIu64 "\n", g_reads_counter/g_read_threads);}
-// 	fprintf(g_output_file, "Number of writes threads: %" PRIu64 "\n", g_write_threads);
-// 	fprintf(g_output_file, "Number of writes counter: %" PRIu64 "\n", g_writes_counter);
-// 	if(g_write_threads != 0)
-// 	{fprintf(g_output_file, "Average writes operations counter: %" PRIu64 "\n", g_writes_counter/g_write_threads);}
+int32_t readBatchJNA(uint64_t divisions[], uint32_t count, uint32_t read_size, char* dest){
+	uint32_t sector_div = g_device->read_bytes / g_ref_tab_columns;
+	uint32_t copy = read_size < sector_div ? read_size : sector_div;
+	uint64_t* offsets = malloc(count * sizeof(uint64_t));
+	uint8_t** buffers = malloc(count * sizeof(uint8_t*));
+	bool* referenced = malloc(count * sizeof(bool));
+	uint8_t* p_buffer = cf_valloc((size_t)count * g_device->read_bytes);
+	uint32_t i, n = 0, found = 0;
+	uint64_t start_ticks = stats_op_begin();
+	bool corrupt = false;
+	int32_t result;
+
+	if (! (offsets && buffers && referenced && p_buffer)) {
+		printf("=> ERROR: read batch cf_valloc()\n");
+		result = RAW_ERR_IO;
+		goto done;
+	}
+
+	for (i = 0; i < count; i++) {
+		uint64_t offset = ((divisions[i] / g_ref_tab_columns) % g_device->num_read_offsets) *
+				g_device->min_op_bytes;
+
+		referenced[i] = ! is_sector_free(offset / g_device->read_bytes,
+				divisions[i] % g_ref_tab_columns);
+		if (referenced[i]) {
+			offsets[n] = offset;
+			buffers[n] = p_buffer + (size_t)n * g_device->read_bytes;
+			n++;
+		}
+	}
+
+	if (n) {
+		bool admitted = qos_begin(QOS_READ, (uint64_t)n * g_device->read_bytes, false);
+		bool ok = read_sectors(offsets, n, buffers);
+		qos_end(QOS_READ, admitted);
+
+		if (! ok) {
+			result = RAW_ERR_IO;
+			goto done;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		char* message = dest + (size_t)i * read_size;
+
+		memset(message, '\0', read_size);
+		if (referenced[i] && copy > 1) {
+			const uint8_t* payload;
+			uint32_t len;
+
+			// A bad sub-sector is left zeroed and fails the batch once the rest are copied.
+			if (open_sector_div(buffers[found] + sector_div * (divisions[i] % g_ref_tab_columns),
+					sector_div, &payload, &len) != RAW_OK) {
+				corrupt = true;
+			}
+			else {
+				strncpy(message, (const char*)payload, len < copy - 1 ? len : copy - 1);
+			}
+		}
+		found += referenced[i];
+	}
+	result = corrupt ? RAW_ERR_CORRUPT : (int32_t)found;
+
+done:
+	stats_op_end(RAWSTAT_OP_READ, start_ticks, (uint64_t)n * g_device->read_bytes, result >= 0);
+	free(offsets);
+	free(buffers);
+	free(referenced);
+	free(p_buffer);
+	return result;
+}
+
+//------------------------------------------------
+// Snapshot of the library's counters for JNA
+//
+bool statsJNA(rawstat_snapshot* snapshot){
+	pthread_once(&g_stats_once, stats_init);
+
+	if (! g_stats || ! snapshot) {
+		return false;
+	}
+
+	stats_publish();
+	rawstat_collect(g_stats, snapshot);
+	return true;
+}
+
+//------------------------------------------------
+// Stream every occupied sub_sector to a callback for JNA
+//
+int64_t scanJNA(scan_callback callback, void* udata, uint32_t batch_size){
+	uint32_t sector_div = g_device->read_bytes / g_ref_tab_columns;
+	uint64_t divisions_per_sector = g_device->read_bytes / g_device->min_op_bytes;
+	scan_record* records = malloc((batch_size ? batch_size : 1) * sizeof(scan_record));
+	scan_ring ring;
+	pthread_t reader;
+	int64_t delivered = 0;
+	bool running = true;
+	uint32_t i, count = 0;
+
+	if (! records || ! callback) {
+		free(records);
+		return RAW_ERR_ARG;
+	}
+	if (! batch_size) {
+		batch_size = 1;
+	}
+
+	// The scan sees everything written before it started.
+	flush_pending();
+
+	memset(&ring, 0, sizeof(scan_ring));
+	pthread_mutex_init(&ring.lock, NULL);
+	pthread_cond_init(&ring.cond, NULL);
+
+	for (i = 0; i < SCAN_READ_AHEAD; i++) {
+		if (! (ring.chunks[i].buffer = cf_valloc(g_large_block_ops_bytes))) {
+			printf("=> ERROR: scan buffer cf_valloc()\n");
+			delivered = RAW_ERR_IO;
+			goto done;
+		}
+	}
+
+	if (pthread_create(&reader, NULL, scan_reader_op, &ring) != 0) {
+		printf("=> ERROR: couldn't start scan reader thread\n");
+		delivered = RAW_ERR_IO;
+		goto done;
+	}
+
+	while (running) {
+		pthread_mutex_lock(&ring.lock);
+		while (! ring.chunks[ring.tail].filled && ! ring.done) {
+			pthread_cond_wait(&ring.cond, &ring.lock);
+		}
+		scan_chunk* chunk = &ring.chunks[ring.tail];
+		bool have = chunk->filled;
+		pthread_mutex_unlock(&ring.lock);
+
+		if (! have) {
+			break;
+		}
+		if (! chunk->ok) {
+			delivered = RAW_ERR_IO;
+			break;
+		}
+
+		uint64_t first_bit = chunk->first_sector * g_ref_tab_columns;
+		uint64_t end_bit = first_bit + (uint64_t)chunk->num_sectors * g_ref_tab_columns;
+		uint64_t bit = first_bit;
+
+		while (running && (bit = ref_map_next_set(&g_device->ref_tab, bit)) < end_bit) {
+			const uint8_t* payload;
+			uint32_t len;
+
+			// Sub-sectors that fail verification are skipped and counted as corrupt.
+			if (open_sector_div(chunk->buffer + (bit - first_bit) / g_ref_tab_columns * g_device->read_bytes +
+					(bit % g_ref_tab_columns) * sector_div, sector_div, &payload, &len) != RAW_OK) {
+				bit++;
+				continue;
+			}
+
+			// Bits count sectors of read_bytes, divisions count min_op_bytes
+			// offsets - report the division whose read returns this payload.
+			records[count].division = (bit / g_ref_tab_columns) * divisions_per_sector * g_ref_tab_columns +
+					bit % g_ref_tab_columns;
+			records[count].payload = (const char*)payload;
+			records[count].size = strnlen((const char*)payload, len);
+			count++;
+			bit++;
+
+			if (count == batch_size) {
+				running = callback(records, count, udata);
+				delivered += count;
+				count = 0;
+			}
+		}
+
+		// Payloads point into this chunk, so hand them over before reuse.
+		if (running && count) {
+			running = callback(records, count, udata);
+			delivered += count;
+			count = 0;
+		}
+
+		pthread_mutex_lock(&ring.lock);
+		chunk->filled = false;
+		ring.tail = (ring.tail + 1) % SCAN_READ_AHEAD;
+		ring.stop = ! running;
+		pthread_cond_broadcast(&ring.cond);
+		pthread_mutex_unlock(&ring.lock);
+	}
+
+	pthread_mutex_lock(&ring.lock);
+	ring.stop = true;
+	pthread_cond_broadcast(&ring.cond);
+	pthread_mutex_unlock(&ring.lock);
+	pthread_join(reader, NULL);
+
+done:
+	for (i = 0; i < SCAN_READ_AHEAD; i++) {
+		free(ring.chunks[i].buffer);
+	}
+	pthread_mutex_destroy(&ring.lock);
+	pthread_cond_destroy(&ring.cond);
+	free(records);
+	return delivered;
+}
+
+//------------------------------------------------
+// Configure the I/O scheduler for JNA (depth 0 turns it off)
+//
+bool setQosJNA(uint32_t depth, uint32_t read_weight, uint32_t write_weight, uint32_t background_weight){
+	if (depth && ! (read_weight && write_weight && background_weight)) {
+		return false;
+	}
+
+	pthread_mutex_lock(&g_qos.lock);
+	g_qos.weights[QOS_READ] = read_weight;
+	g_qos.weights[QOS_WRITE] = write_weight;
+	g_qos.weights[QOS_BACKGROUND] = background_weight;
+	g_qos.depth = depth;
+	pthread_cond_broadcast(&g_qos.cond);
+	pthread_mutex_unlock(&g_qos.lock);
+	return true;
+}
+
+//------------------------------------------------
+// Limit write bandwidth and IOPS for JNA (0 - unlimited), with or without
+// setQosJNA
+//
+void setWriteLimitsJNA(uint64_t bytes_per_sec, uint64_t iops){
+	pthread_mutex_lock(&g_qos.lock);
+	// A tenth of a second of burst, but always room for one large request.
+	token_bucket_config(&g_qos.write_bytes, bytes_per_sec,
+			bytes_per_sec / 10 > g_large_block_ops_bytes ? bytes_per_sec / 10 : g_large_block_ops_bytes);
+	token_bucket_config(&g_qos.write_iops, iops, iops / 10 > 1 ? iops / 10 : 1);
+	pthread_mutex_unlock(&g_qos.lock);
+}
+
+//------------------------------------------------
+// Store and verify a length + CRC32C header in every sub_sector for JNA
+// (a format choice - set it before writing, and keep it for the device's life)
+//
+void setChecksumsJNA(bool enabled){
+	pthread_once(&g_crc32c_once, crc32c_init);
+	g_checksums = enabled;
+}
+
+//------------------------------------------------
+// Compress putRecordJNA records for JNA, optionally against a dictionary of
+// sample records (set it up front - not while records are being put or got)
+//
+bool setCompressionJNA(bool enabled, char* dict, uint32_t dict_size){
+	lz4b_dict* p_dict = NULL;
+
+	if (dict && dict_size){
+		if (! (p_dict = malloc(sizeof(lz4b_dict)))){
+			printf("=> ERROR: compression dictionary malloc()\n");
+			return false;
+		}
+		lz4b_dict_init(p_dict, (const uint8_t*)dict, dict_size);
+
+		// Records remember which dictionary they need.
+		pthread_once(&g_crc32c_once, crc32c_init);
+		g_codec_dict_id = crc32c(0, p_dict->data, p_dict->len);
+	}
+
+	free(g_codec_dict);
+	g_codec_dict = p_dict;
+	g_codec = enabled;
+	return true;
+}
+
+//------------------------------------------------
+// Store a record, compressed when that helps, in the best-fitting size
+// class for JNA. Returns its handle.
+//
+int64_t putRecordJNA(char* message, uint32_t size){
+	uint8_t* p_record;
+
+	if (! message || ! size || size > RECORD_LEN_MASK){
+		return RAW_ERR_ARG;
+	}
+
+	if (! (p_record = codec_scratch(RECORD_HEADER_BYTES + LZ4B_BOUND(size)))){
+		printf("=> ERROR: record codec buffer realloc()\n");
+		return RAW_ERR_IO;
+	}
+
+	uint32_t stored = record_pack(message, size, p_record);
+	int64_t record = allocRecordJNA(stored);
+
+	if (record < 0){
+		return record;
+	}
+
+	size_class* cls = &g_device->classes[record >> RECORD_CLASS_SHIFT];
+	uint64_t start_ticks = stats_op_begin();
+	int32_t result = record_io(cls, record & RECORD_SLOT_MASK, (char*)p_record, stored, true);
+
+	stats_op_end(RAWSTAT_OP_WRITE, start_ticks, cls->slot_bytes, result >= 0);
+
+	if (result < 0){
+		freeRecordJNA((uint64_t)record);
+		return result;
+	}
+	return record;
+}
+
+//------------------------------------------------
+// Read back and decompress a putRecordJNA record for JNA. Returns the bytes
+// copied to dest - the whole record if dest_size allows.
+//
+int32_t getRecordJNA(uint64_t record, char* dest, uint32_t dest_size){
+	uint32_t c = (uint32_t)(record >> RECORD_CLASS_SHIFT);
+	uint64_t slot = record & RECORD_SLOT_MASK;
+
+	if (! dest || c >= g_device->num_classes || slot >= g_device->classes[c].num_slots) {
+		return RAW_ERR_ARG;
+	}
+
+	if (! ref_map_test(&g_device->classes[c].slots, slot)) {
+		thread_stats()->not_found++;
+		return RAW_ERR_NOT_FOUND;
+	}
+
+	size_class* cls = &g_device->classes[c];
+	uint8_t* p_record = codec_scratch(cls->slot_bytes);
+
+	if (! p_record){
+		printf("=> ERROR: record codec buffer realloc()\n");
+		return RAW_ERR_IO;
+	}
+
+	uint64_t start_ticks = stats_op_begin();
+	int32_t result = record_io(cls, slot, (char*)p_record, cls->slot_bytes, false);
+
+	stats_op_end(RAWSTAT_OP_READ, start_ticks, cls->slot_bytes, result >= 0);
+
+	if (result < 0){
+		return result;
+	}
+	return record_unpack(p_record, cls->slot_bytes, dest, dest_size);
+}
+
+//------------------------------------------------
+// Choose how single-sector I/O waits for completion for JNA. Spinning is
+// capped at cpu_budget_pct of a core per thread; past it, a thread waits on
+// interrupts until the next budget window.
+//
+bool setPollModeJNA(uint32_t mode, uint32_t cpu_budget_pct){
+	if (mode > POLL_FULL || cpu_budget_pct == 0 || cpu_budget_pct > 100){
+		return false;
+	}
+
+	g_poll_budget_pct = cpu_budget_pct;
+	g_poll_mode = mode;
+	return true;
+}
+
+//------------------------------------------------
+// Choose when writes count as done for JNA. With FUA or group commit a
+// write returns true only once it is durable; batched writes wait for the
+// flush that carries them (started at once when there is no flusher).
+//
+bool setDurabilityJNA(uint32_t mode, uint32_t group_window_us){
+	if (mode > DURABILITY_GROUP){
+		return false;
+	}
+
+	// Leaving a mode - make what it acknowledged durable first.
+	bool ok = syncJNA();
+
+	pthread_mutex_lock(&g_commit.lock);
+	g_commit.mode = mode;
+	g_commit.window_us = group_window_us;
+	pthread_mutex_unlock(&g_commit.lock);
+
+	return ok;
+}
+
+//------------------------------------------------
+// Write out batched sectors and flush the drive cache for JNA. Returns true
+// once everything written so far is durable.
+//
+bool syncJNA(){
+	int fd = g_fd_device;
+	bool ok = flush_all();
+
+	if (fd == -1){
+		return ok;
+	}
+
+	uint64_t start_ticks = cf_ticks();
+	int rc = fdatasync(fd);
+
+	if (rc != 0){
+		printf("=> ERROR: fdatasync failed (%d)\n", errno);
+	}
+
+	rawstat_thread* stats = thread_stats();
+
+	stats->durable_syncs++;
+	stats->durable_sync_writes++;
+	stats->durable_wait_ns += cf_ticks_to_ns(cf_ticks() - start_ticks);
+
+	return ok && rc == 0;
+}
+
+//------------------------------------------------
+// Prefetch sequential and strided readJNA/readIntoJNA streams into a pool
+// of max_sectors sectors for JNA (0 turns read-ahead off). Not while reads
+// are running.
+//
+bool setReadAheadJNA(uint32_t max_sectors){
+	uint32_t i;
+
+	pthread_mutex_lock(&g_readahead.lock);
+	bool had_prefetcher = g_readahead.running;
+	g_readahead.running = false;
+	pthread_cond_signal(&g_readahead.cond);
+	pthread_mutex_unlock(&g_readahead.lock);
+
+	if (had_prefetcher) {
+		pthread_join(g_readahead.prefetcher, NULL);
+	}
+
+	pthread_mutex_lock(&g_readahead.lock);
+
+	for (i = 0; i < g_readahead.num_slots; i++) {
+		free(g_readahead.slots[i].buffer);
+	}
+	free(g_readahead.slots);
+	g_readahead.slots = NULL;
+	g_readahead.num_slots = 0;
+	g_readahead.queue_count = 0;
+	g_readahead.generation++;
+
+	if (! max_sectors) {
+		pthread_mutex_unlock(&g_readahead.lock);
+		return true;
+	}
+
+	// Buffers come later, as slots are first used.
+	if (! (g_readahead.slots = calloc(max_sectors, sizeof(ra_slot)))) {
+		pthread_mutex_unlock(&g_readahead.lock);
+		printf("=> ERROR: read-ahead pool calloc()\n");
+		return false;
+	}
+
+	// A stream may hold at most a quarter of the pool.
+	g_readahead.max_window = max_sectors / 4 < READAHEAD_MAX_WINDOW ? max_sectors / 4 : READAHEAD_MAX_WINDOW;
+	if (! g_readahead.max_window) {
+		g_readahead.max_window = 1;
+	}
+	g_readahead.min_window = g_readahead.max_window < READAHEAD_MIN_WINDOW ?
+			g_readahead.max_window : READAHEAD_MIN_WINDOW;
+	g_readahead.num_slots = max_sectors;
+	g_readahead.running = true;
+
+	if (pthread_create(&g_readahead.prefetcher, NULL, prefetcher_op, NULL) != 0) {
+		printf("=> ERROR: couldn't start prefetcher thread\n");
+		free(g_readahead.slots);
+		g_readahead.slots = NULL;
+		g_readahead.num_slots = 0;
+		g_readahead.running = false;
+		pthread_mutex_unlock(&g_readahead.lock);
+		return false;
+	}
+
+	pthread_mutex_unlock(&g_readahead.lock);
+	return true;
+}
+
+//------------------------------------------------
+// Get one or more available sub-sectors for JNA 
+//
+// static char* myStrncpy(char *s1, const char *s2, size_t n, char c){
+
+// 	char *s = s1;
+// 	while (n > 0 && *s2 != '\0') {
+// 		*s++ = *s2++;
+// 		--n;
+//     }
+//     while (n > 0) {
+//     	if (n > 2)
+//     	{*s++ = c;}
+//     	else
+// 		{*s++ = '\0';}
+// 		--n;
+//     }
+// }
+
+//======================================================================================================
+// Threads
+//
+
+//------------------------------------------------
+// Flusher thread: writes queued sectors out once the oldest one is due.
+//
+static void *flusher_op(void *arg){
+	pthread_mutex_lock(&g_flush.lock);
+
+	while (g_flush.running){
+		uint64_t now_us = cf_getus(), wait_us = g_flush.deadline_us;
+
+		if (g_flush.count){
+			uint64_t due_us = g_flush.entries[0].queued_us + g_flush.deadline_us;
+
+			if (now_us >= due_us){
+				pthread_mutex_unlock(&g_flush.lock);
+				flush_pending();
+				pthread_mutex_lock(&g_flush.lock);
+				continue;
+			}
+			wait_us = due_us - now_us;
+		}
+
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += (ts.tv_nsec + wait_us * 1000) / 1000000000;
+		ts.tv_nsec = (ts.tv_nsec + wait_us * 1000) % 1000000000;
+		pthread_cond_timedwait(&g_flush.cond, &g_flush.lock, &ts);
+	}
+
+	pthread_mutex_unlock(&g_flush.lock);
+	return NULL;
+}
+
+//------------------------------------------------
+// Prefetcher thread: loads queued read-ahead sectors, merging neighbours.
+//
+static void *prefetcher_op(void *arg){
+	uint64_t offsets[READAHEAD_BATCH];
+	uint8_t* buffers[READAHEAD_BATCH];
+	ra_request batch[READAHEAD_BATCH];
+	uint32_t i, num;
+
+	pthread_mutex_lock(&g_readahead.lock);
+
+	while (g_readahead.running){
+		if (! g_readahead.queue_count){
+			pthread_cond_wait(&g_readahead.cond, &g_readahead.lock);
+			continue;
+		}
+
+		for (num = 0; num < READAHEAD_BATCH && g_readahead.queue_count; num++){
+			batch[num] = g_readahead.queue[g_readahead.queue_head];
+			g_readahead.queue_head = (g_readahead.queue_head + 1) % READAHEAD_QUEUE;
+			g_readahead.queue_count--;
+
+			ra_slot* slot = &g_readahead.slots[batch[num].slot];
+
+			offsets[num] = slot->offset;
+			buffers[num] = slot->buffer;
+		}
+
+		// Loading slots are ours - nobody else writes their buffers.
+		pthread_mutex_unlock(&g_readahead.lock);
+		bool admitted = qos_begin(QOS_BACKGROUND, (uint64_t)num * g_device->read_bytes, false);
+		bool ok = read_sectors(offsets, num, buffers);
+		qos_end(QOS_BACKGROUND, admitted);
+		pthread_mutex_lock(&g_readahead.lock);
+
+		for (i = 0; i < num; i++){
+			ra_slot* slot = &g_readahead.slots[batch[i].slot];
+
+			slot->state = ok && slot->seq == batch[i].seq ? RA_READY : RA_EMPTY;
+		}
+		pthread_cond_broadcast(&g_readahead.loaded);
+	}
+
+	// Whatever is still queued stays unloaded.
+	for (i = 0; i < g_readahead.queue_count; i++){
+		g_readahead.slots[g_readahead.queue[(g_readahead.queue_head + i) % READAHEAD_QUEUE].slot].state = RA_EMPTY;
+	}
+	g_readahead.queue_count = 0;
+	pthread_cond_broadcast(&g_readahead.loaded);
+
+	pthread_mutex_unlock(&g_readahead.lock);
+	return NULL;
+}
+
+//------------------------------------------------
+// Scan reader thread: reads occupied large blocks ahead of the scan,
+// skipping regions with no referenced sub_sectors. Every free chunk of the
+// ring is read at once through an io_uring, falling back to one pread at a
+// time without it.
+//
+static void *scan_reader_op(void *arg){
+	scan_ring* ring = (scan_ring*)arg;
+	uint64_t device_bytes = g_device->num_large_blocks * g_large_block_ops_bytes;
+	uint64_t num_sectors = device_bytes / g_device->read_bytes;
+	uint32_t chunk_sectors = g_large_block_ops_bytes / g_device->read_bytes;
+	scan_chunk* batch[SCAN_READ_AHEAD];
+	uring uring;
+	bool have_uring = uring_init(&uring, false);
+	bool more = true;
+	uint64_t bit = 0;
+	uint32_t i, num;
+
+	if (! chunk_sectors) {
+		chunk_sectors = 1;
+	}
+
+	while (more){
+		pthread_mutex_lock(&ring->lock);
+		while (ring->chunks[ring->head].filled && ! ring->stop){
+			pthread_cond_wait(&ring->cond, &ring->lock);
+		}
+		bool stop = ring->stop;
+		for (num = 0; num < SCAN_READ_AHEAD && ! ring->chunks[(ring->head + num) % SCAN_READ_AHEAD].filled; num++){
+			batch[num] = &ring->chunks[(ring->head + num) % SCAN_READ_AHEAD];
+		}
+		pthread_mutex_unlock(&ring->lock);
+
+		if (stop){
+			break;
+		}
+
+		// Give each free chunk the next occupied large block.
+		uint64_t batch_bytes = 0;
+		uint32_t planned = 0;
+
+		while (planned < num){
+			if ((bit = ref_map_next_set(&g_device->ref_tab, bit)) >= g_device->ref_tab.num_bits ||
+					bit / g_ref_tab_columns >= num_sectors){
+				more = false;
+				break;
+			}
+
+			uint64_t sector = bit / g_ref_tab_columns;
+			uint64_t first_sector = sector - (sector % chunk_sectors);
+			uint64_t left = num_sectors - first_sector;
+
+			batch[planned]->first_sector = first_sector;
+			batch[planned]->num_sectors = left < chunk_sectors ? (uint32_t)left : chunk_sectors;
+			batch[planned]->ok = false;
+			batch_bytes += (uint64_t)batch[planned]->num_sectors * g_device->read_bytes;
+			bit = (first_sector + batch[planned]->num_sectors) * g_ref_tab_columns;
+			planned++;
+		}
+
+		if (! planned){
+			break;
+		}
+
+		// The whole batch is one background request to the scheduler.
+		bool admitted = qos_begin(QOS_BACKGROUND, batch_bytes, false);
+
+		uint32_t submitted = 0, completed = 0;
+
+		for (i = 0; have_uring && i < planned; i++){
+			if (! uring_submit(&uring, g_fd_device, batch[i]->first_sector * g_device->read_bytes,
+					batch[i]->num_sectors * g_device->read_bytes, batch[i]->buffer, false, 0, false)){
+				break;
+			}
+			submitted++;
+		}
+
+		// Hand chunks over as they complete - the scan waits on them in order.
+		for (i = 0; i < planned; i++){
+			scan_chunk* chunk = batch[i];
+
+			if (completed < submitted){
+				struct io_uring_cqe* cqe;
+
+				while (! (cqe = uring_peek(&uring))){
+					syscall(__NR_io_uring_enter, uring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+				}
+				for (chunk = ring->chunks; (uintptr_t)chunk->buffer != cqe->user_data; chunk++){
+				}
+				chunk->ok = cqe->res == (int32_t)(chunk->num_sectors * g_device->read_bytes);
+				__atomic_store_n(uring.cq_head, *uring.cq_head + 1, __ATOMIC_RELEASE);
+				completed++;
+			}
+			else {
+				chunk->ok = read_from_device(g_device, chunk->first_sector * g_device->read_bytes,
+						chunk->num_sectors * g_device->read_bytes, chunk->buffer);
+			}
+
+			pthread_mutex_lock(&ring->lock);
+			chunk->filled = true;
+			pthread_cond_broadcast(&ring->cond);
+			pthread_mutex_unlock(&ring->lock);
+		}
+
+		qos_end(QOS_BACKGROUND, admitted);
+
+		pthread_mutex_lock(&ring->lock);
+		ring->head = (ring->head + planned) % SCAN_READ_AHEAD;
+		pthread_mutex_unlock(&ring->lock);
+	}
+
+	if (have_uring){
+		uring_free(&uring);
+	}
+
+	pthread_mutex_lock(&ring->lock);
+	ring->done = true;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
+	return NULL;
+}
+
+//------------------------------------------------
+// Stats publisher thread: refreshes the gauges rawstat reads.
+//
+static void *stats_publisher_op(void *arg){
+	while (true){
+		stats_publish();
+		usleep(RAWSTAT_PUBLISH_US);
+	}
+	return NULL;
+}
+
+//------------------------------------------------
+// Thread Creation Operation.
+//
+// static bool thread_creation_op(int num_of_threads){
+// 	int i;
+// 	pthread_t threads[num_of_threads];
+
+// 	if (num_of_threads < 0 || num_of_threads > THREADS_MAX_NUM){
+// 		printf("=> ERROR: invalid number of threads!\n");
+// 		return false;
+// 	}
+	
+// 	// for (i=0; i < (num_of_threads); i++){
+// 	// 	int *thread_num = malloc(sizeof(int *));
+// 	// 	*thread_num = (int)g_running_threads;
+
+// 	// 	//READ ONLY
+// 	// 	pthread_create(&(threads[i]), NULL, read_op, thread_num);
+
+// 	// 	pthread_mutex_lock(&running_mutex);
+// 	// 	g_read_threads++;
+//  //    	g_running_threads++;
+//  //    	pthread_mutex_unlock(&running_mutex);
+
+//  //    	//WRITE ONLY
+//  //    	pthread_create(&(threads[i]), NULL, write_op, thread_num);
+
+// 	// 	pthread_mutex_lock(&running_mutex);
+// 	// 	g_write_threads++;
+//  //    	g_running_threads++;
+//  //    	pthread_mutex_unlock(&running_mutex);
+// 	// }
+	
+// 	// READ AND WRITE
+// 	for (i=0; i < (num_of_threads*3)/4; i++){
+// 		int *thread_num = malloc(sizeof(int *));
+// 		*thread_num = (int)g_running_threads;
+// 		pthread_create(&(threads[i]), NULL, read_op, thread_num);
+
+// 		pthread_mutex_lock(&running_mutex);
+// 		g_read_threads++;
+//     	g_running_threads++;
+//     	pthread_mutex_unlock(&running_mutex);
+
+// 	}
+// 	for (i= (num_of_threads*3)/4; i < num_of_threads; i++){
+// 		int *thread_num = malloc(sizeof(int *));
+// 		*thread_num = (int)g_running_threads;
+// 		pthread_create(&(threads[i]), NULL, write_op, thread_num);
+
+// 		pthread_mutex_lock(&running_mutex);
+// 		g_write_threads++;
+//     	g_running_threads++;
+//     	pthread_mutex_unlock(&running_mutex);
+// 	}
+
+// 	return true;
+// }
+
+//------------------------------------------------
+// Thread Read Operation.
+//
+// static void *read_op(void *thread_num){
+// 	int counter = 0;	
+// 	uint64_t begin_op_time, offset;
+// 	void* p_buffer = cf_valloc(g_device->read_bytes);
+
+// 	if (! p_buffer) {
+// 		printf("=> ERROR: read buffer cf_valloc()\n");
+// 		return NULL;
+// 	}
+
+// 	while (g_running){
+// 		offset = random_read_offset(g_device);
+// 		begin_op_time = cf_getus();
+// 		if (! read_from_device(g_device, offset, g_device->read_bytes, p_buffer)){
+// 			printf("=> ERROR read op number: %d; Offset: %" PRIu64 "\n", counter+1, offset);
+// 		}
+// 		else{
+// 			array_add(safe_delta_ns(begin_op_time, cf_getus())/10);
+// 			counter++;
+// 		}
+// 	}
+
+// 	pthread_mutex_lock(&running_mutex);
+// 	g_reads_counter += counter;
+// 	g_running_threads--;
+// 	pthread_mutex_unlock(&running_mutex);
+
+	
+
+//    	free(p_buffer);
+//    	free(thread_num);
+//    	return NULL;
+// }
+
+//------------------------------------------------
+// Thread Write Operation.
+//
+// static void *write_op(void *thread_num){
+// 	int counter = 0;
+// 	uint64_t begin_op_time, offset;
+// 	char* message = "Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Hello SSD.Regards, thread";
+// 	void* p_buffer = cf_valloc(g_device->read_bytes);
+
+// 	if (! p_buffer) {
+// 		printf("=> ERROR: write buffer cf_valloc()\n");
+// 		return NULL;
+// 	}
+
+// 	//strcpy(p_buffer, message);
+
+// 	while (g_running){
+// 		offset = random_read_offset(g_device);
+// 		int division = rand()%g_ref_tab_columns;
+// 		if (is_sector_free(offset/g_device->read_bytes, division)){
+// 			prep_to_sector_div(offset, division , p_buffer, message, strlen(message));
+// 			begin_op_time = cf_getus();
+// 			if (! write_to_device(g_device, offset, g_device->read_bytes, p_buffer)){
+// 				printf("=> ERROR write op number: %d; Offset: %" PRIu64 "\n", counter+1, offset);
+// 			}
+// 			else{
+// 				array_add(safe_delta_ns(begin_op_time, cf_getus())/10);
+// 				add_sector_ref(offset/g_device->read_bytes, division);
+// 				counter++;
+// 			}
+// 		}
+// 	}
+
+// 	pthread_mutex_lock(&running_mutex);
+// 	g_writes_counter += counter;
+// 	g_running_threads--;
+// 	pthread_mutex_unlock(&running_mutex);
+
+//    	free(p_buffer);
+//    	free(thread_num);
+//    	return NULL;
+// }
+
+//======================================================================================================
+// Flush Scheduler
+//
+
+//------------------------------------------------
+// Find a queued sector. Open entries are newer than ones being flushed.
+// Caller holds g_flush.lock.
+//
+static pending_write* flush_find_locked(uint64_t offset, bool* p_open){
+	uint32_t i;
+
+	for (i = 0; i < g_flush.count; i++) {
+		if (g_flush.entries[i].offset == offset) {
+			*p_open = true;
+			return &g_flush.entries[i];
+		}
+	}
+	for (i = 0; i < g_flush.num_flushing; i++) {
+		if (g_flush.flushing[i].offset == offset) {
+			*p_open = false;
+			return &g_flush.flushing[i];
+		}
+	}
+	return NULL;
+}
+
+//------------------------------------------------
+// Read one sector, seeing writes that are still queued.
+//
+static bool read_sector(uint64_t offset, void* p_buffer){
+	if (g_flush.max_pending && read_sector_pending(offset, p_buffer)) {
+		return true;
+	}
+
+	return read_from_device(g_device, offset, g_device->read_bytes, p_buffer);
+}
+
+//------------------------------------------------
+// Queue a sub_sector write. Writes to a sector that is already queued are
+// patched into the same buffer.
+//
+static bool flush_enqueue(uint64_t offset, uint32_t division, char* message, uint32_t write_size){
+	flush_ticket* ticket = NULL;
+	pending_write* p_write;
+	bool open, due, ok;
+
+	pthread_mutex_lock(&g_flush.lock);
+
+	// Make room unless the sector can be patched where it already is.
+	while (! ((p_write = flush_find_locked(offset, &open)) && open) &&
+			g_flush.count >= g_flush.max_pending) {
+		pthread_mutex_unlock(&g_flush.lock);
+		flush_pending();
+		pthread_mutex_lock(&g_flush.lock);
+	}
+
+	if (! p_write || ! open) {
+		uint8_t* p_buffer = cf_valloc(g_device->read_bytes);
+
+		if (! p_buffer) {
+			pthread_mutex_unlock(&g_flush.lock);
+			printf("=> ERROR: flush buffer cf_valloc()\n");
+			return false;
+		}
+
+		// A sector already on its way out is the newest copy to start from.
+		if (p_write) {
+			memcpy(p_buffer, p_write->buffer, g_device->read_bytes);
+		}
+		else if (! read_from_device(g_device, offset, g_device->read_bytes, p_buffer)) {
+			pthread_mutex_unlock(&g_flush.lock);
+			printf("=> ERROR read op. FLUSH_ENQUEUE. Offset: %" PRIu64 "\n", offset);
+			free(p_buffer);
+			return false;
+		}
+
+		p_write = &g_flush.entries[g_flush.count++];
+		p_write->offset = offset;
+		p_write->buffer = p_buffer;
+		p_write->queued_us = cf_getus();
+	}
+
+	patch_sector_div(p_write->buffer, division, message, write_size);
+
+	// A durable write is only done once the flush carrying it has committed.
+	if (g_commit.mode != DURABILITY_NONE) {
+		if (! g_flush.ticket && ! (g_flush.ticket = calloc(1, sizeof(flush_ticket)))) {
+			pthread_mutex_unlock(&g_flush.lock);
+			printf("=> ERROR: flush ticket calloc()\n");
+			return false;
+		}
+		ticket = g_flush.ticket;
+		ticket->waiters++;
+	}
+
+	// Without a deadline only a full queue is due - or a durable writer, as
+	// no flusher would ever come for it.
+	due = g_flush.count >= g_flush.max_pending || (g_flush.deadline_us &&
+			cf_getus() - g_flush.entries[0].queued_us >= g_flush.deadline_us) ||
+			(ticket && ! g_flush.running);
+
+	pthread_mutex_unlock(&g_flush.lock);
+
+	ok = due ? flush_pending() : true;
+
+	if (! ticket) {
+		return ok;
+	}
+
+	pthread_mutex_lock(&g_flush.lock);
+	while (! ticket->done) {
+		pthread_cond_wait(&g_flush.committed, &g_flush.lock);
+	}
+	ok = ticket->ok;
+	if (--ticket->waiters == 0) {
+		free(ticket);
+	}
+	pthread_mutex_unlock(&g_flush.lock);
+	return ok;
+}
+
+//------------------------------------------------
+// Order queued writes by offset.
+//
+static int compare_pending(const void* a, const void* b){
+	uint64_t offset_a = ((const pending_write*)a)->offset;
+	uint64_t offset_b = ((const pending_write*)b)->offset;
+	return offset_a < offset_b ? -1 : offset_a > offset_b;
+}
+
+//------------------------------------------------
+// Write every queued sector, merging neighbours into vectored writes of up
+// to one large block.
+//
+static bool flush_pending(){
+	struct iovec iov[FLUSH_MAX_IOV];
+	rawstat_thread* stats = thread_stats();
+	flush_ticket* ticket;
+	pending_write* batch;
+	uint32_t i, num, iov_count = 0;
+	uint64_t run_offset = 0, run_bytes = 0;
+	bool ok = true;
+
+	pthread_mutex_lock(&g_flush.io_lock);
+
+	// Detach the open entries; readers still find them in 'flushing'. Sort
+	// them first, so readers never scan an array that is being reordered.
+	pthread_mutex_lock(&g_flush.lock);
+	if (g_flush.count) {
+		qsort(g_flush.entries, g_flush.count, sizeof(pending_write), compare_pending);
+	}
+	batch = g_flush.entries;
+	num = g_flush.count;
+	g_flush.entries = g_flush.flushing;
+	g_flush.flushing = batch;
+	g_flush.num_flushing = num;
+	g_flush.count = 0;
+	ticket = g_flush.ticket;
+	g_flush.ticket = NULL;
+	pthread_mutex_unlock(&g_flush.lock);
+
+	for (i = 0; i < num; i++) {
+		if (iov_count && (batch[i].offset != run_offset + run_bytes ||
+				run_bytes + g_device->read_bytes > g_large_block_ops_bytes ||
+				iov_count == FLUSH_MAX_IOV)) {
+			bool admitted = qos_begin(QOS_BACKGROUND, run_bytes, true);
+			ok = write_vec_to_device(g_device, run_offset, iov, iov_count, run_bytes) && ok;
+			qos_end(QOS_BACKGROUND, admitted);
+			stats->flush_requests++;
+			iov_count = 0;
+		}
+		if (! iov_count) {
+			run_offset = batch[i].offset;
+			run_bytes = 0;
+		}
+		iov[iov_count].iov_base = batch[i].buffer;
+		iov[iov_count].iov_len = g_device->read_bytes;
+		iov_count++;
+		run_bytes += g_device->read_bytes;
+	}
+
+	if (iov_count) {
+		bool admitted = qos_begin(QOS_BACKGROUND, run_bytes, true);
+		ok = write_vec_to_device(g_device, run_offset, iov, iov_count, run_bytes) && ok;
+		qos_end(QOS_BACKGROUND, admitted);
+		stats->flush_requests++;
+	}
+
+	if (num) {
+		stats->flushes++;
+		stats->flush_sectors += num;
+		stats->bytes[RAWSTAT_OP_WRITE] += (uint64_t)num * g_device->read_bytes;
+	}
+
+	pthread_mutex_lock(&g_flush.lock);
+	for (i = 0; i < num; i++) {
+		free(batch[i].buffer);
+	}
+	g_flush.num_flushing = 0;
+	pthread_mutex_unlock(&g_flush.lock);
+
+	pthread_mutex_unlock(&g_flush.io_lock);
+
+	// One commit for the whole batch, outside the flush lock.
+	if (num && ok) {
+		ok = durability_commit();
+	}
+
+	// Writers not waiting on a ticket hear of a failure at flushJNA/syncJNA.
+	pthread_mutex_lock(&g_flush.lock);
+	g_flush.failed = g_flush.failed || ! ok;
+	if (ticket) {
+		ticket->done = true;
+		ticket->ok = ok;
+		pthread_cond_broadcast(&g_flush.committed);
+	}
+	pthread_mutex_unlock(&g_flush.lock);
+
+	return ok;
+}
+
+//------------------------------------------------
+// Write every queued sector and report whether all flushes since the last
+// report succeeded.
+//
+static bool flush_all(){
+	bool ok = flush_pending();
+
+	pthread_mutex_lock(&g_flush.lock);
+	ok = ok && ! g_flush.failed;
+	g_flush.failed = false;
+	pthread_mutex_unlock(&g_flush.lock);
+	return ok;
+}
+
+//------------------------------------------------
+// Order sector reads by offset.
+//
+static int compare_sector_read(const void* a, const void* b){
+	uint64_t offset_a = ((const sector_read*)a)->offset;
+	uint64_t offset_b = ((const sector_read*)b)->offset;
+	return offset_a < offset_b ? -1 : offset_a > offset_b;
+}
+
+//------------------------------------------------
+// Read many sectors, merging neighbours into vectored reads of up to one
+// large block. Repeated offsets are read once.
+//
+static bool read_sectors(const uint64_t* offsets, uint32_t count, uint8_t** buffers){
+	struct iovec iov[FLUSH_MAX_IOV];
+	sector_read* reads = malloc(count * sizeof(sector_read));
+	uint32_t i, iov_count = 0;
+	uint64_t run_offset = 0, run_bytes = 0;
+	bool ok = true;
+
+	if (! reads) {
+		return false;
+	}
+
+	for (i = 0; i < count; i++) {
+		reads[i].offset = offsets[i];
+		reads[i].buffer = buffers[i];
+	}
+	qsort(reads, count, sizeof(sector_read), compare_sector_read);
+
+	for (i = 0; i < count; i++) {
+		// Queued writes are newer than the device.
+		if (g_flush.max_pending && read_sector_pending(reads[i].offset, reads[i].buffer)) {
+			continue;
+		}
+		if (iov_count && reads[i].offset == run_offset + run_bytes - g_device->read_bytes) {
+			continue; // same sector as the previous one, copied below
+		}
+		if (iov_count && (reads[i].offset != run_offset + run_bytes ||
+				run_bytes + g_device->read_bytes > g_large_block_ops_bytes ||
+				iov_count == FLUSH_MAX_IOV)) {
+			ok = read_vec_from_device(g_device, run_offset, iov, iov_count, run_bytes) && ok;
+			iov_count = 0;
+		}
+		if (! iov_count) {
+			run_offset = reads[i].offset;
+			run_bytes = 0;
+		}
+		iov[iov_count].iov_base = reads[i].buffer;
+		iov[iov_count].iov_len = g_device->read_bytes;
+		iov_count++;
+		run_bytes += g_device->read_bytes;
+	}
+
+	if (iov_count) {
+		ok = read_vec_from_device(g_device, run_offset, iov, iov_count, run_bytes) && ok;
+	}
+
+	// Sorted, so duplicates sit right after the copy that was read.
+	for (i = 1; i < count; i++) {
+		if (reads[i].offset == reads[i - 1].offset) {
+			memcpy(reads[i].buffer, reads[i - 1].buffer, g_device->read_bytes);
+		}
+	}
+
+	free(reads);
+	return ok;
+}
+
+//------------------------------------------------
+// Copy a sector out of the write queue if it is there.
+//
+static bool read_sector_pending(uint64_t offset, void* p_buffer){
+	pending_write* p_write;
+	bool open, found = false;
+
+	pthread_mutex_lock(&g_flush.lock);
+	if ((p_write = flush_find_locked(offset, &open))) {
+		memcpy(p_buffer, p_write->buffer, g_device->read_bytes);
+		found = true;
+	}
+	pthread_mutex_unlock(&g_flush.lock);
+
+	if (found) {
+		thread_stats()->staged_hits++;
+	}
+	return found;
+}
+
+//======================================================================================================
+// I/O Scheduler
+//
+
+//------------------------------------------------
+// Admit one device request of the given class, waiting if needed. Returns
+// whether it took a slot, which is what qos_end must be told.
+//
+static bool qos_begin(qos_class cls, uint64_t bytes, bool write){
+	uint64_t wait_ns;
+
+	// Write limits hold whether or not the scheduler is on.
+	if (write && (__atomic_load_n(&g_qos.write_bytes.rate, __ATOMIC_RELAXED) ||
+			__atomic_load_n(&g_qos.write_iops.rate, __ATOMIC_RELAXED))) {
+		pthread_mutex_lock(&g_qos.lock);
+		uint64_t now_ns = cf_getns();
+		uint64_t bytes_ns = token_bucket_take(&g_qos.write_bytes, bytes, now_ns);
+		uint64_t iops_ns = token_bucket_take(&g_qos.write_iops, 1, now_ns);
+		pthread_mutex_unlock(&g_qos.lock);
+
+		if ((wait_ns = bytes_ns > iops_ns ? bytes_ns : iops_ns)) {
+			struct timespec ts = { wait_ns / 1000000000, wait_ns % 1000000000 };
+			nanosleep(&ts, NULL);
+		}
+	}
+
+	if (! g_qos.depth) {
+		return false;
+	}
+
+	// Reads are never held back by queued writes or background work.
+	if (cls == QOS_READ) {
+		__atomic_fetch_add(&g_qos.inflight[QOS_READ], 1, __ATOMIC_ACQ_REL);
+		return true;
+	}
+
+	pthread_mutex_lock(&g_qos.lock);
+	g_qos.waiting[cls]++;
+
+	while (g_qos.depth) {
+		qos_class other = cls == QOS_WRITE ? QOS_BACKGROUND : QOS_WRITE;
+		uint32_t busy = g_qos.inflight[QOS_WRITE] + g_qos.inflight[QOS_BACKGROUND];
+		uint32_t slots = g_qos.depth;
+
+		if (__atomic_load_n(&g_qos.inflight[QOS_READ], __ATOMIC_ACQUIRE)) {
+			uint32_t total = g_qos.weights[QOS_READ] + g_qos.weights[QOS_WRITE] +
+					g_qos.weights[QOS_BACKGROUND];
+			slots = (g_qos.depth * (total - g_qos.weights[QOS_READ])) / total;
+			slots = slots ? slots : 1;
+		}
+
+		// Between writes and background work, the one further behind its
+		// weighted share goes first.
+		if (busy < slots && ! (g_qos.waiting[other] &&
+				g_qos.vtime[other] < g_qos.vtime[cls])) {
+			break;
+		}
+
+		pthread_cond_wait(&g_qos.cond, &g_qos.lock);
+	}
+
+	g_qos.waiting[cls]--;
+	g_qos.inflight[cls]++;
+	g_qos.vtime[cls] += 1000 / g_qos.weights[cls] + 1;
+	pthread_mutex_unlock(&g_qos.lock);
+	return true;
+}
+
+//------------------------------------------------
+// Release the device slot taken by qos_begin. Requests admitted while the
+// scheduler was off hold none, even if it has been turned on since.
+//
+static void qos_end(qos_class cls, bool admitted){
+	if (! admitted) {
+		return;
+	}
+
+	if (cls == QOS_READ) {
+		if (__atomic_sub_fetch(&g_qos.inflight[QOS_READ], 1, __ATOMIC_ACQ_REL) == 0 &&
+				(__atomic_load_n(&g_qos.waiting[QOS_WRITE], __ATOMIC_ACQUIRE) ||
+				__atomic_load_n(&g_qos.waiting[QOS_BACKGROUND], __ATOMIC_ACQUIRE))) {
+			pthread_mutex_lock(&g_qos.lock);
+			pthread_cond_broadcast(&g_qos.cond);
+			pthread_mutex_unlock(&g_qos.lock);
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&g_qos.lock);
+	g_qos.inflight[cls]--;
+
+	// Keep an idle class from banking credit while the other one runs.
+	if (! g_qos.inflight[cls] && ! g_qos.waiting[cls]) {
+		qos_class other = cls == QOS_WRITE ? QOS_BACKGROUND : QOS_WRITE;
+		if (g_qos.vtime[cls] < g_qos.vtime[other]) {
+			g_qos.vtime[cls] = g_qos.vtime[other];
+		}
+	}
+
+	pthread_cond_broadcast(&g_qos.cond);
+	pthread_mutex_unlock(&g_qos.lock);
+}
+
+//------------------------------------------------
+// Set a token bucket's rate and size. Caller holds g_qos.lock.
+//
+static void token_bucket_config(token_bucket* tb, uint64_t rate, uint64_t burst){
+	tb->rate = rate;
+	tb->burst = (int64_t)burst;
+	tb->tokens = (int64_t)burst;
+	tb->last_ns = cf_getns();
+}
+
+//------------------------------------------------
+// Take tokens, returning how long the caller must wait to cover any debt.
+// Caller holds g_qos.lock.
+//
+static uint64_t token_bucket_take(token_bucket* tb, uint64_t amount, uint64_t now_ns){
+	if (! tb->rate) {
+		return 0;
+	}
+
+	uint64_t earned = (uint64_t)(((unsigned __int128)(now_ns - tb->last_ns) * tb->rate) / 1000000000);
+
+	// Only move the clock by the time actually paid out, so frequent small
+	// refills don't round the rate down to nothing.
+	if (earned) {
+		tb->tokens += (int64_t)earned;
+		tb->last_ns += (uint64_t)(((unsigned __int128)earned * 1000000000) / tb->rate);
+		if (tb->tokens >= tb->burst) {
+			tb->tokens = tb->burst;
+			tb->last_ns = now_ns;
+		}
+	}
+
+	tb->tokens -= (int64_t)amount;
+
+	return tb->tokens >= 0 ? 0 :
+			(uint64_t)(((unsigned __int128)(-tb->tokens) * 1000000000) / tb->rate);
+}
+
+//======================================================================================================
+// Polled I/O
+//
+
+//------------------------------------------------
+// Do one device op in the configured polling mode. Returns false when the
+// caller should do it with a plain interrupt-driven pread/pwrite instead.
+//
+static bool poll_rw(int fd, uint64_t offset, uint32_t size, void* p_buffer, bool write, ssize_t* result){
+	uint32_t mode = g_poll_mode;
+	bool full = mode == POLL_FULL;
+	int rw_flags = write ? durability_rw_flags() : 0;
+
+	if (mode == POLL_INTERRUPT || (full && g_iopoll_unsupported)) {
+		return false;
+	}
+
+	poll_thread* pt = thread_poll();
+	rawstat_thread* stats = thread_stats();
+
+	if (! pt) {
+		return false;
+	}
+
+	uint64_t start_ticks = cf_ticks();
+	uint64_t now_ns = cf_ticks_to_ns(start_ticks);
+
+	if (now_ns - pt->window_start_ns >= POLL_BUDGET_WINDOW_NS) {
+		pt->window_start_ns = now_ns;
+		pt->window_spin_ns = 0;
+	}
+	if (pt->window_spin_ns * 100 >= (uint64_t)g_poll_budget_pct * POLL_BUDGET_WINDOW_NS) {
+		stats->poll_degraded++;
+		return false;
+	}
+
+	if (! pt->ring_state[full]) {
+		pt->ring_state[full] = uring_init(&pt->rings[full], full) ? 1 : -1;
+	}
+
+	if (pt->ring_state[full] < 0) {
+		// No io_uring - full polling can still ask for a polled sync op.
+		if (! full) {
+			return false;
+		}
+		struct iovec iov = { p_buffer, size };
+		*result = write ? pwritev2(fd, &iov, 1, offset, RWF_HIPRI | rw_flags) :
+				preadv2(fd, &iov, 1, offset, RWF_HIPRI);
+		pt->window_spin_ns += cf_ticks_to_ns(cf_ticks() - start_ticks);
+		stats->poll_ops++;
+		return true;
+	}
+
+	uring* ring = &pt->rings[full];
+	struct io_uring_cqe* cqe = NULL;
+	uint64_t spin_ns;
+
+	if (! uring_submit(ring, fd, offset, size, p_buffer, write, rw_flags, full)) {
+		return false;
+	}
+
+	if (full) {
+		// The kernel polled for the completion inside io_uring_enter.
+		while (! (cqe = uring_peek(ring))) {
+			syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		}
+		spin_ns = cf_ticks_to_ns(cf_ticks() - start_ticks);
+	}
+	else {
+		// Spin only if the completion usually comes within the cap.
+		uint64_t expected_ns = pt->expected_ns[write];
+		uint64_t spin_limit_ns = expected_ns <= POLL_HYBRID_MAX_SPIN_NS ? expected_ns + expected_ns / 4 : 0;
+
+		while (! (cqe = uring_peek(ring)) &&
+				(spin_ns = cf_ticks_to_ns(cf_ticks() - start_ticks)) < spin_limit_ns) {
+#ifdef CF_HAS_TSC
+			_mm_pause();
+#endif
+		}
+		spin_ns = cf_ticks_to_ns(cf_ticks() - start_ticks);
+		if (spin_ns > spin_limit_ns) {
+			spin_ns = spin_limit_ns;
+		}
+
+		if (! cqe) {
+			stats->poll_sleeps++;
+			while (! (cqe = uring_peek(ring))) {
+				syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+			}
+		}
+	}
+
+	int32_t res = cqe->res;
+
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+
+	uint64_t latency_ns = cf_ticks_to_ns(cf_ticks() - start_ticks);
+
+	pt->expected_ns[write] += ((int64_t)latency_ns - (int64_t)pt->expected_ns[write]) / 8;
+	pt->window_spin_ns += spin_ns;
+	stats->poll_spin_ns += spin_ns;
+	stats->poll_ops++;
+
+	if (full && res == -EOPNOTSUPP) {
+		if (! __atomic_exchange_n(&g_iopoll_unsupported, true, __ATOMIC_RELAXED)) {
+			printf("=> ERROR: %s doesn't support polled I/O, using interrupts\n", g_device_name);
+		}
+		return false;
+	}
+
+	*result = res;
+	return true;
+}
+
+//------------------------------------------------
+// Get the calling thread's rings and latency estimates.
+//
+static poll_thread* thread_poll(){
+	if (! t_poll) {
+		pthread_once(&g_poll_once, poll_key_init);
+
+		if (! (t_poll = calloc(1, sizeof(poll_thread)))) {
+			return NULL;
+		}
+		// Start out expecting a fast device, so hybrid tries spinning first.
+		t_poll->expected_ns[0] = t_poll->expected_ns[1] = POLL_HYBRID_MAX_SPIN_NS / 2;
+		pthread_setspecific(g_poll_key, t_poll);
+	}
+	return t_poll;
+}
+
+//------------------------------------------------
+// Close a thread's rings when it exits.
+//
+static void poll_thread_free(void* arg){
+	poll_thread* pt = (poll_thread*)arg;
+	uint32_t i;
+
+	for (i = 0; i < 2; i++) {
+		if (pt->ring_state[i] > 0) {
+			uring_free(&pt->rings[i]);
+		}
+	}
+	free(pt);
+}
+
+static void poll_key_init(){
+	pthread_key_create(&g_poll_key, poll_thread_free);
+}
+
+//------------------------------------------------
+// Set up a small io_uring, interrupt-driven or polled.
+//
+static bool uring_init(uring* ring, bool iopoll){
+	struct io_uring_params params;
+
+	memset(&params, 0, sizeof(params));
+	params.flags = iopoll ? IORING_SETUP_IOPOLL : 0;
+
+	ring->fd = (int)syscall(__NR_io_uring_setup, POLL_RING_ENTRIES, &params);
+	if (ring->fd < 0) {
+		printf("=> ERROR: io_uring_setup failed (%d), doing without it\n", errno);
+		return false;
+	}
+
+	ring->sq_ring_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_bytes = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_bytes = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_bytes > ring->sq_ring_bytes) {
+			ring->sq_ring_bytes = ring->cq_ring_bytes;
+		}
+		ring->cq_ring_bytes = ring->sq_ring_bytes;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_ring = params.features & IORING_FEAT_SINGLE_MMAP ? ring->sq_ring :
+			mmap(NULL, ring->cq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring->fd, IORING_OFF_SQES);
+
+	if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		printf("=> ERROR: io_uring mmap failed\n");
+		uring_free(ring);
+		return false;
+	}
+
+	ring->sq_tail = (unsigned*)((uint8_t*)ring->sq_ring + params.sq_off.tail);
+	ring->sq_mask = (unsigned*)((uint8_t*)ring->sq_ring + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned*)((uint8_t*)ring->sq_ring + params.sq_off.array);
+	ring->cq_head = (unsigned*)((uint8_t*)ring->cq_ring + params.cq_off.head);
+	ring->cq_tail = (unsigned*)((uint8_t*)ring->cq_ring + params.cq_off.tail);
+	ring->cq_mask = (unsigned*)((uint8_t*)ring->cq_ring + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)((uint8_t*)ring->cq_ring + params.cq_off.cqes);
+
+	return true;
+}
+
+//------------------------------------------------
+// Unmap and close a ring.
+//
+static void uring_free(uring* ring){
+	if (ring->sq_ring && ring->sq_ring != MAP_FAILED) {
+		munmap(ring->sq_ring, ring->sq_ring_bytes);
+	}
+	if (ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+		munmap(ring->cq_ring, ring->cq_ring_bytes);
+	}
+	if (ring->sqes && ring->sqes != MAP_FAILED) {
+		munmap(ring->sqes, ring->sqes_bytes);
+	}
+	close(ring->fd);
+}
+
+//------------------------------------------------
+// Queue one read or write and submit it, waiting for it if asked to.
+//
+static bool uring_submit(uring* ring, int fd, uint64_t offset, uint32_t size, void* p_buffer, bool write, int rw_flags, bool wait){
+	unsigned tail = *ring->sq_tail;
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe* sqe = &ring->sqes[index];
+	long submitted;
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)p_buffer;
+	sqe->len = size;
+	sqe->off = offset;
+	sqe->rw_flags = rw_flags;
+	sqe->user_data = (uint64_t)(uintptr_t)p_buffer; // tells apart completions of several requests
+	ring->sq_array[index] = index;
+
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	do {
+		submitted = syscall(__NR_io_uring_enter, ring->fd, 1, wait ? 1 : 0,
+				wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (submitted < 0 && errno == EINTR);
+
+	if (submitted < 0) {
+		printf("=> ERROR: io_uring_enter failed (%d)\n", errno);
+		return false;
+	}
+	return true;
+}
+
+//------------------------------------------------
+// Next completion, or NULL if there is none yet.
+//
+static struct io_uring_cqe* uring_peek(uring* ring){
+	unsigned head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+//======================================================================================================
+// Durability
+//
+
+//------------------------------------------------
+// Extra pwritev2 flags the durability mode asks for.
+//
+static inline int durability_rw_flags(){
+	return g_commit.mode == DURABILITY_FUA ? RWF_DSYNC : 0;
+}
+
+//------------------------------------------------
+// Called once a write operation has reached the device and given back its
+// QoS slot and locks. In group mode, wait until a cache flush covers it -
+// leading the flush if none is under way.
+//
+static bool durability_commit(){
+	int fd = g_fd_device;
+
+	if (g_commit.mode != DURABILITY_GROUP || fd == -1) {
+		return true;
+	}
+
+	rawstat_thread* stats = thread_stats();
+	uint64_t start_ticks = cf_ticks();
+
+	pthread_mutex_lock(&g_commit.lock);
+
+	uint64_t ticket = ++g_commit.write_seq;
+
+	while (g_commit.synced_seq < ticket) {
+		if (g_commit.syncing) {
+			pthread_cond_wait(&g_commit.cond, &g_commit.lock);
+			continue;
+		}
+
+		g_commit.syncing = true;
+
+		if (g_commit.window_us) {
+			// Give writers that are just behind us a chance to join.
+			struct timespec ts;
+			uint64_t wait_ns = (uint64_t)g_commit.window_us * 1000;
+
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += (ts.tv_nsec + wait_ns) / 1000000000;
+			ts.tv_nsec = (ts.tv_nsec + wait_ns) % 1000000000;
+
+			while (pthread_cond_timedwait(&g_commit.cond, &g_commit.lock, &ts) != ETIMEDOUT) {
+			}
+		}
+
+		uint64_t target = g_commit.write_seq;
+		uint64_t covered = target - g_commit.synced_seq;
+
+		pthread_mutex_unlock(&g_commit.lock);
+		int rc = fdatasync(fd);
+		pthread_mutex_lock(&g_commit.lock);
+
+		if (rc == 0) {
+			g_commit.durable_seq = target;
+		}
+		else {
+			printf("=> ERROR: fdatasync failed (%d), %" PRIu64 " writes not durable\n", errno, covered);
+			g_commit.failed_seq = target;
+		}
+
+		g_commit.synced_seq = target;
+		g_commit.syncing = false;
+		stats->durable_syncs++;
+		stats->durable_sync_writes += covered;
+		pthread_cond_broadcast(&g_commit.cond);
+	}
+
+	// A failure may have covered a write already made durable - err on the
+	// side of reporting it as lost.
+	bool ok = g_commit.durable_seq >= ticket && ticket > g_commit.failed_seq;
+
+	pthread_mutex_unlock(&g_commit.lock);
+
+	stats->durable_wait_ns += cf_ticks_to_ns(cf_ticks() - start_ticks);
+	return ok;
+}
+
+//======================================================================================================
+// Read-Ahead
+//
+
+//------------------------------------------------
+// Read one sector for readJNA/readIntoJNA - from the write queue, the
+// read-ahead pool or the device - and feed the caller's stream detector.
+//
+static bool read_sector_ahead(uint64_t offset, void* p_buffer){
+	if (! g_readahead.num_slots) {
+		return read_sector(offset, p_buffer);
+	}
+
+	if (g_flush.max_pending && read_sector_pending(offset, p_buffer)) {
+		readahead_access(offset, true);
+		return true;
+	}
+
+	bool hit = readahead_lookup(offset, p_buffer);
+
+	readahead_access(offset, hit);
+
+	return hit || read_from_device(g_device, offset, g_device->read_bytes, p_buffer);
+}
+
+//------------------------------------------------
+// Copy a prefetched sector out of the pool, waiting for it if it is on its
+// way.
+//
+static bool readahead_lookup(uint64_t offset, void* p_buffer){
+	rawstat_thread* stats = thread_stats();
+	bool hit = false, late = false;
+
+	pthread_mutex_lock(&g_readahead.lock);
+
+	if (g_readahead.num_slots) {
+		ra_slot* slot = &g_readahead.slots[(offset / g_device->min_op_bytes) % g_readahead.num_slots];
+
+		while (slot->offset == offset && slot->state == RA_LOADING) {
+			late = true;
+			pthread_cond_wait(&g_readahead.loaded, &g_readahead.lock);
+		}
+
+		if (slot->offset == offset && slot->state == RA_READY) {
+			memcpy(p_buffer, slot->buffer, g_device->read_bytes);
+			slot->used = true;
+			hit = true;
+		}
+	}
+
+	pthread_mutex_unlock(&g_readahead.lock);
+
+	if (hit) {
+		stats->ra_hits++;
+		stats->ra_late += late;
+	}
+	return hit;
+}
+
+//------------------------------------------------
+// Follow the calling thread's reads. Once they keep a stride, keep a
+// window of sectors prefetched ahead of them, sized by how many of the
+// prefetched sectors are there when the reads reach them.
+//
+static void readahead_access(uint64_t offset, bool hit){
+	ra_stream* st = &t_stream;
+
+	if (st->generation != g_readahead.generation) {
+		memset(st, 0, sizeof(ra_stream));
+		st->generation = g_readahead.generation;
+		st->last_offset = offset;
+		return;
+	}
+
+	int64_t delta = (int64_t)(offset - st->last_offset);
+
+	if (! delta) {
+		return; // another sub_sector of the same sector
+	}
+	st->last_offset = offset;
+
+	if (delta != st->stride || delta > READAHEAD_MAX_STRIDE || delta < -READAHEAD_MAX_STRIDE) {
+		st->stride = delta;
+		st->run = 0;
+		st->window = 0;
+		return;
+	}
+
+	if (++st->run < READAHEAD_TRIGGER) {
+		return;
+	}
+
+	if (! st->window) {
+		st->window = g_readahead.min_window;
+		st->frontier = offset + st->stride;
+		st->hits = st->misses = 0;
+	}
+	else {
+		if (hit) {
+			st->hits++;
+		}
+		else {
+			st->misses++;
+		}
+
+		if (st->hits + st->misses >= st->window) {
+			if (! st->misses) {
+				st->window = st->window * 2 < g_readahead.max_window ? st->window * 2 : g_readahead.max_window;
+			}
+			else if (st->misses > st->hits) {
+				st->window = st->window / 2 > g_readahead.min_window ? st->window / 2 : g_readahead.min_window;
+			}
+			st->hits = st->misses = 0;
+		}
+	}
+
+	// Fell behind the reader (requests dropped) - start again from here.
+	if (st->stride > 0 ? st->frontier <= offset : st->frontier >= offset) {
+		st->frontier = offset + st->stride;
+	}
+
+	readahead_request(st, offset);
+}
+
+//------------------------------------------------
+// Queue prefetches up to a window ahead of offset.
+//
+static void readahead_request(ra_stream* st, uint64_t offset){
+	rawstat_thread* stats = thread_stats();
+	uint64_t limit = offset + (int64_t)st->window * st->stride;
+	uint32_t queued = 0;
+
+	pthread_mutex_lock(&g_readahead.lock);
+
+	while (g_readahead.num_slots && (st->stride > 0 ? st->frontier <= limit : st->frontier >= limit) &&
+			st->frontier / g_device->min_op_bytes < g_device->num_read_offsets) {
+		uint32_t index = (st->frontier / g_device->min_op_bytes) % g_readahead.num_slots;
+		ra_slot* slot = &g_readahead.slots[index];
+
+		if (g_readahead.queue_count == READAHEAD_QUEUE) {
+			break; // the prefetcher is behind - try again next read
+		}
+
+		// Never steal a slot that is loading; skip sectors already here.
+		if (slot->state == RA_LOADING || (slot->state == RA_READY && slot->offset == st->frontier)) {
+			st->frontier += st->stride;
+			continue;
+		}
+
+		if (! slot->buffer && ! (slot->buffer = cf_valloc(g_device->read_bytes))) {
+			break;
+		}
+
+		if (slot->state == RA_READY && ! slot->used) {
+			stats->ra_wasted++;
+		}
+
+		slot->offset = st->frontier;
+		slot->state = RA_LOADING;
+		slot->used = false;
+		slot->seq++;
+
+		g_readahead.queue[(g_readahead.queue_head + g_readahead.queue_count) % READAHEAD_QUEUE] =
+				(ra_request){ index, slot->seq };
+		g_readahead.queue_count++;
+		queued++;
+
+		st->frontier += st->stride;
+	}
+
+	if (queued) {
+		pthread_cond_signal(&g_readahead.cond);
+	}
+
+	pthread_mutex_unlock(&g_readahead.lock);
+
+	stats->ra_issued += queued;
+}
+
+//------------------------------------------------
+// Drop prefetched copies of sectors a device write overlapped.
+//
+static void readahead_invalidate(uint64_t offset, uint64_t size){
+	if (! g_readahead.num_slots) {
+		return;
+	}
+
+	uint64_t step = g_device->min_op_bytes;
+	uint64_t first = offset + step > g_device->read_bytes ? offset + step - g_device->read_bytes : 0;
+	uint64_t o;
+	uint32_t wasted = 0;
+
+	first -= first % step;
+
+	pthread_mutex_lock(&g_readahead.lock);
+
+	for (o = first; g_readahead.num_slots && o < offset + size; o += step) {
+		ra_slot* slot = &g_readahead.slots[(o / step) % g_readahead.num_slots];
+
+		if (slot->offset != o || slot->state == RA_EMPTY) {
+			continue;
+		}
+
+		if (slot->state == RA_READY) {
+			wasted += ! slot->used;
+			slot->state = RA_EMPTY;
+		}
+		slot->seq++; // a load in flight is stale now
+	}
+
+	pthread_mutex_unlock(&g_readahead.lock);
+
+	thread_stats()->ra_wasted += wasted;
+}
+
+//======================================================================================================
+// Metrics
+//
+
+//------------------------------------------------
+// Create the counters segment, shared if possible so rawstat can poll it.
+//
+static void stats_init(){
+	void* p_segment = MAP_FAILED;
+	pthread_t publisher;
+	int fd;
+
+	cf_ticks_init();
+	pthread_key_create(&g_stats_key, thread_stats_free);
+	stats_unlink_stale();
+	snprintf(g_stats_shm_name, sizeof(g_stats_shm_name), RAWSTAT_SHM_PREFIX "%d", (int)getpid());
+	fd = shm_open(g_stats_shm_name, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+	if (fd != -1) {
+		if (ftruncate(fd, sizeof(rawstat_segment)) == 0) {
+			p_segment = mmap(NULL, sizeof(rawstat_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		}
+		close(fd);
+	}
+
+	if (p_segment == MAP_FAILED) {
+		// Still count, just not visible outside the process.
+		printf("=> ERROR: couldn't share counters as %s\n", g_stats_shm_name);
+		if (fd != -1) {
+			shm_unlink(g_stats_shm_name);
+		}
+		if (! (p_segment = cf_valloc(sizeof(rawstat_segment)))) {
+			return;
+		}
+		memset(p_segment, 0, sizeof(rawstat_segment));
+	}
+	else {
+		atexit(stats_unlink);
+	}
+
+	g_stats = (rawstat_segment*)p_segment;
+	g_stats->version = RAWSTAT_VERSION;
+	g_stats->pid = (int32_t)getpid();
+	__atomic_store_n(&g_stats->magic, RAWSTAT_MAGIC, __ATOMIC_RELEASE);
+
+	if (pthread_create(&publisher, NULL, stats_publisher_op, NULL) == 0) {
+		pthread_detach(publisher);
+	}
+}
+
+//------------------------------------------------
+// Remove the shared counters segment at exit.
+//
+static void stats_unlink(){
+	shm_unlink(g_stats_shm_name);
+}
+
+//------------------------------------------------
+// Remove segments left behind by processes that were killed before their
+// exit handlers ran.
+//
+static void stats_unlink_stale(){
+	const char* prefix = RAWSTAT_SHM_PREFIX + 1; // shm names start with '/'
+	struct dirent* entry;
+	char name[sizeof(entry->d_name) + 1];
+	DIR* dir;
+	int pid;
+
+	if (! (dir = opendir("/dev/shm"))) {
+		return;
+	}
+
+	while ((entry = readdir(dir))) {
+		if (strncmp(entry->d_name, prefix, strlen(prefix)) != 0 ||
+				(pid = atoi(entry->d_name + strlen(prefix))) <= 0) {
+			continue;
+		}
+		if (kill(pid, 0) == -1 && errno == ESRCH) {
+			snprintf(name, sizeof(name), "/%s", entry->d_name);
+			shm_unlink(name);
+		}
+	}
+	closedir(dir);
+}
+
+//------------------------------------------------
+// Refresh the gauges in the counters segment.
+//
+static void stats_publish(){
+	device* p_device = g_device;
+	uint64_t bits = 0, set = 0, bytes = 0;
+	uint32_t c;
+
+	if (! g_stats) {
+		return;
+	}
+
+	if (p_device) {
+		if (p_device->ref_tab.num_bits) {
+			bits += p_device->ref_tab.num_bits;
+			set += p_device->ref_tab.num_set;
+			bytes += ref_map_bytes(&p_device->ref_tab);
+		}
+		for (c = 0; c < p_device->num_classes; c++) {
+			bits += p_device->classes[c].slots.num_bits;
+			set += p_device->classes[c].slots.num_set;
+			bytes += ref_map_bytes(&p_device->classes[c].slots);
+		}
+	}
+
+	__atomic_store_n(&g_stats->queued_writes, g_flush.count, __ATOMIC_RELAXED);
+	__atomic_store_n(&g_stats->bitmap_bits, bits, __ATOMIC_RELAXED);
+	__atomic_store_n(&g_stats->bitmap_set, set, __ATOMIC_RELAXED);
+	__atomic_store_n(&g_stats->bitmap_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+//------------------------------------------------
+// Get the calling thread's counters slot.
+//
+static inline rawstat_thread* thread_stats(){
+	if (! t_stats) {
+		t_stats = thread_stats_slot();
+	}
+	return t_stats;
+}
+
+//------------------------------------------------
+// Assign the calling thread a slot, reusing one of an exited thread first.
+//
+static rawstat_thread* thread_stats_slot(){
+	static rawstat_thread s_discard;
+	rawstat_thread* stats = NULL;
+	uint32_t slot;
+
+	pthread_once(&g_stats_once, stats_init);
+	if (! g_stats) {
+		return &s_discard;
+	}
+
+	pthread_mutex_lock(&g_stats_lock);
+	if (g_stats_num_free) {
+		stats = &g_stats->threads[g_stats_free[--g_stats_num_free]];
+	}
+	else if ((slot = g_stats->num_threads) < RAWSTAT_MAX_THREADS) {
+		stats = &g_stats->threads[slot];
+		__atomic_store_n(&g_stats->num_threads, slot + 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&g_stats_lock);
+
+	if (! stats) {
+		// More live threads than slots - count privately until exit, when the
+		// counts are folded into the retired totals like everyone else's.
+		if (! (stats = (rawstat_thread*)cf_valloc(sizeof(rawstat_thread)))) {
+			return &s_discard;
+		}
+		memset(stats, 0, sizeof(rawstat_thread));
+	}
+
+	pthread_setspecific(g_stats_key, stats);
+	return stats;
+}
+
+//------------------------------------------------
+// Fold an exiting thread's counts into the retired totals and give its slot
+// back.
+//
+static void thread_stats_free(void* arg){
+	rawstat_thread* stats = (rawstat_thread*)arg;
+	uint64_t* from = (uint64_t*)stats;
+	uint64_t* to = (uint64_t*)&g_stats->retired;
+	bool in_segment = stats >= g_stats->threads && stats < g_stats->threads + RAWSTAT_MAX_THREADS;
+	uint32_t i;
+
+	pthread_mutex_lock(&g_stats_lock);
+	__atomic_store_n(&g_stats->retire_seq, g_stats->retire_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	// The slot is all counters, so fold it word by word.
+	for (i = 0; i < sizeof(rawstat_thread) / sizeof(uint64_t); i++) {
+		__atomic_store_n(&to[i], to[i] + from[i], __ATOMIC_RELAXED);
+		__atomic_store_n(&from[i], 0, __ATOMIC_RELAXED);
+	}
+
+	__atomic_store_n(&g_stats->retire_seq, g_stats->retire_seq + 1, __ATOMIC_RELEASE);
+	if (in_segment) {
+		g_stats_free[g_stats_num_free++] = (uint32_t)(stats - g_stats->threads);
+	}
+	pthread_mutex_unlock(&g_stats_lock);
+
+	if (! in_segment) {
+		free(stats);
+	}
+	t_stats = NULL;
+}
+
+//------------------------------------------------
+// Start timing an operation.
+//
+static inline uint64_t stats_op_begin(){
+	thread_stats()->inflight++;
+	return cf_ticks();
+}
+
+//------------------------------------------------
+// Count a finished operation and its latency.
+//
+static inline void stats_op_end(rawstat_op op, uint64_t start_ticks, uint64_t bytes, bool ok){
+	rawstat_thread* stats = t_stats;
+	uint64_t ns = cf_ticks_to_ns(cf_ticks() - start_ticks);
+	uint32_t bucket = 63 - __builtin_clzll(ns | 1);
+
+	if (bucket >= RAWSTAT_LAT_BUCKETS) {
+		bucket = RAWSTAT_LAT_BUCKETS - 1;
+	}
+
+	stats->inflight--;
+	if (ok) {
+		stats->ops[op]++;
+		stats->bytes[op] += bytes;
+	}
+	else {
+		stats->errors[op]++;
+	}
+	stats->lat[op][bucket]++;
+}
+
+//------------------------------------------------
+// Per-thread buffer for readJNA results. JNA copies the returned string,
+// so it can be reused by the thread's next call.
+//
+static char* thread_message(uint32_t size){
+	if (size > t_message_bytes) {
+		char* message = realloc(t_message, size);
+
+		if (! message) {
+			return NULL;
+		}
+		t_message = message;
+		t_message_bytes = size;
+	}
+	return t_message;
+}
+
+//======================================================================================================
+// Record Codec
+//
+
+//------------------------------------------------
+// Per-thread buffer holding a record on its way to or from the device.
+//
+static uint8_t* codec_scratch(uint32_t size){
+	if (size > t_codec_bytes) {
+		uint8_t* p_buffer = realloc(t_codec, size);
+
+		if (! p_buffer) {
+			return NULL;
+		}
+		t_codec = p_buffer;
+		t_codec_bytes = size;
+	}
+	return t_codec;
+}
+
+//------------------------------------------------
+// Build header and payload in p_record, compressing if that saves space.
+// Returns the bytes to store.
+//
+static uint32_t record_pack(const char* message, uint32_t size, uint8_t* p_record){
+	record_header header = { ((uint32_t)RECORD_PACKED << 24) | size, size, 0, 0 };
+	uint8_t* payload = p_record + RECORD_HEADER_BYTES;
+	uint32_t stored = 0;
+
+	pthread_once(&g_crc32c_once, crc32c_init);
+	header.raw_crc = crc32c(0, (const uint8_t*)message, size);
+
+	if (g_codec) {
+		const lz4b_dict* dict = g_codec_dict;
+		rawstat_thread* stats = thread_stats();
+		uint64_t start_ticks = cf_ticks();
+
+		// Anything not strictly smaller is stored as is.
+		stored = lz4b_compress((const uint8_t*)message, size, payload, size - 1, dict);
+
+		stats->codec_compress_ns += cf_ticks_to_ns(cf_ticks() - start_ticks);
+		stats->codec_compress_ops++;
+		stats->codec_raw_bytes += size;
+		stats->codec_stored_bytes += stored ? stored : size;
+
+		if (stored) {
+			header.len_flags = ((uint32_t)(RECORD_PACKED | RECORD_LZ4 | (dict ? RECORD_DICT : 0)) << 24) | stored;
+			header.dict_id = dict ? g_codec_dict_id : 0;
+		}
+	}
+
+	if (! stored) {
+		memcpy(payload, message, size);
+		stored = size;
+	}
+
+	memcpy(p_record, &header, sizeof(header));
+	return RECORD_HEADER_BYTES + stored;
+}
+
+//------------------------------------------------
+// Check a stored record's header, copy or decompress its payload, and verify
+// the result against the original bytes' CRC32C.
+//
+static int32_t record_unpack(const uint8_t* p_record, uint32_t slot_bytes, char* dest, uint32_t dest_size){
+	record_header header;
+
+	memcpy(&header, p_record, sizeof(header));
+
+	uint32_t flags = header.len_flags >> 24;
+	uint32_t stored = header.len_flags & RECORD_LEN_MASK;
+	uint32_t raw = header.raw_bytes;
+	const uint8_t* payload = p_record + RECORD_HEADER_BYTES;
+
+	if (! (flags & RECORD_PACKED) || stored + RECORD_HEADER_BYTES > slot_bytes || raw > RECORD_LEN_MASK) {
+		thread_stats()->corrupt++;
+		return RAW_ERR_CORRUPT;
+	}
+
+	pthread_once(&g_crc32c_once, crc32c_init);
+
+	if (! (flags & RECORD_LZ4)) {
+		uint32_t copy = stored < dest_size ? stored : dest_size;
+
+		if (stored != raw || crc32c(0, payload, stored) != header.raw_crc) {
+			thread_stats()->corrupt++;
+			return RAW_ERR_CORRUPT;
+		}
+		memcpy(dest, payload, copy);
+		return (int32_t)copy;
+	}
+
+	const lz4b_dict* dict = NULL;
+
+	if (flags & RECORD_DICT) {
+		// Compressed against a dictionary this process doesn't have.
+		if (! g_codec_dict || header.dict_id != g_codec_dict_id) {
+			return RAW_ERR_ARG;
+		}
+		dict = g_codec_dict;
+	}
+
+	// Short destinations get the head of the record, via the message buffer.
+	char* out = dest_size >= raw ? dest : thread_message(raw);
+
+	if (! out) {
+		return RAW_ERR_IO;
+	}
+
+	rawstat_thread* stats = thread_stats();
+	uint64_t start_ticks = cf_ticks();
+	int32_t result = lz4b_decompress(payload, stored, (uint8_t*)out, raw, dict);
+
+	stats->codec_decompress_ns += cf_ticks_to_ns(cf_ticks() - start_ticks);
+	stats->codec_decompress_ops++;
+
+	// A wrong dictionary can still decompress to the right length.
+	if (result != (int32_t)raw || crc32c(0, (const uint8_t*)out, raw) != header.raw_crc) {
+		stats->corrupt++;
+		return RAW_ERR_CORRUPT;
+	}
+
+	if (out != dest) {
+		memcpy(dest, out, dest_size);
+		result = (int32_t)dest_size;
+	}
+	return result;
+}
+
+//======================================================================================================
+// Helpers
+//
+
+//------------------------------------------------
+// Print information from the test
+//
+// static void print_final_info(uint64_t main_total_time){
+// 	fprintf(g_output_file, "__________________________________________\n");
+// 	fprintf(g_output_file, "Total time: %" PRIu64 " s\n", main_total_time/1000000);
+// 	fprintf(g_output_file, "Total threads created: %d\n", g_read_threads + g_write_threads);
+// 	fprintf(g_output_file, "Number of reads threads: %" PRIu64 "\n", g_read_threads);
+// 	fprintf(g_output_file, "Number of reads counter: %" PRIu64 "\n", g_reads_counter);
+// 	if(g_read_threads != 0)
+// 	{fprintf(g_output_file, "Average reads operations counter: %" PRIu64 "\n", g_reads_counter/g_read_threads);}
+// 	fprintf(g_output_file, "Number of writes threads: %" PRIu64 "\n", g_write_threads);
+// 	fprintf(g_output_file, "Number of writes counter: %" PRIu64 "\n", g_writes_counter);
+// 	if(g_write_threads != 0)
+// 	{fprintf(g_output_file, "Average writes operations counter: %" PRIu64 "\n", g_writes_counter/g_write_threads);}
 // 	fprintf(g_output_file, "Reads per second: %" PRIu64 "\n", g_reads_counter/(main_total_time/1000000));
 // 	fprintf(g_output_file, "Writes per second: %" PRIu64 "\n", g_writes_counter/(main_total_time/1000000));
 		
@@ -575,9 +3452,9 @@ static bool config_parse_device_name(char *p_device_name){
 	strcpy(g_device_name, p_device_name);
 	device* dev = malloc(sizeof(device));
 	if(dev){
+		memset(dev, 0, sizeof(device));
 		dev->name = g_device_name;
 		g_device = dev;
-		g_device->ref_tab = NULL;
 	}else
 	{return false;}
 	
@@ -684,35 +3561,90 @@ static bool read_from_device(device* p_device,uint64_t offset,uint32_t size, voi
 		return false;
 	}
 
-	if (lseek(fd, offset, SEEK_SET) != offset ||
-			read(fd, p_buffer, size) != (ssize_t)size) {
-		close(fd);
-		printf("=> ERROR: Couldn't seek & read\n");
+	ssize_t done;
+
+	// pread rather than lseek + read - threads share the descriptor.
+	if (! poll_rw(fd, offset, size, p_buffer, false, &done)) {
+		done = pread(fd, p_buffer, size, offset);
+	}
+
+	if (done != (ssize_t)size) {
+		close(fd);
+		printf("=> ERROR: Couldn't seek & read\n");
+		return false;
+	}
+	
+	//uint64_t stop_ns = cf_getns();
+	return true;
+}
+
+//------------------------------------------------
+// Do one device write operation.
+//
+static bool write_to_device(device* p_device, uint64_t offset, uint32_t size, void* p_buffer) {
+	int fd = g_fd_device; //fd_get(p_device);
+
+	if (fd == -1) {
+		return false;
+	}
+
+	ssize_t done;
+
+	if (! poll_rw(fd, offset, size, p_buffer, true, &done)) {
+		struct iovec iov = { p_buffer, size };
+
+		done = pwritev2(fd, &iov, 1, offset, durability_rw_flags());
+	}
+
+	if (done != (ssize_t)size) {
+		close(fd);
+		printf("=> ERROR: Couldn't seek & write\n");
+		return false;
+	}
+
+	readahead_invalidate(offset, size);
+
+	//uint64_t stop_ns = cf_getns();
+	return true;
+}
+
+//------------------------------------------------
+// Do one vectored device read operation.
+//
+static bool read_vec_from_device(device* p_device, uint64_t offset,
+		const struct iovec* iov, int iov_count, uint64_t size) {
+	int fd = g_fd_device;
+
+	if (fd == -1) {
+		return false;
+	}
+
+	if (preadv(fd, iov, iov_count, offset) != (ssize_t)size) {
+		printf("=> ERROR: Couldn't preadv %" PRIu64 " bytes at %" PRIu64 "\n", size, offset);
 		return false;
 	}
-	
-	//uint64_t stop_ns = cf_getns();
+
 	return true;
 }
 
 //------------------------------------------------
-// Do one device write operation.
+// Do one vectored device write operation.
 //
-static bool write_to_device(device* p_device, uint64_t offset, uint32_t size, void* p_buffer) {
-	int fd = g_fd_device; //fd_get(p_device);
+static bool write_vec_to_device(device* p_device, uint64_t offset,
+		const struct iovec* iov, int iov_count, uint64_t size) {
+	int fd = g_fd_device;
 
 	if (fd == -1) {
 		return false;
 	}
 
-	if (lseek(fd, offset, SEEK_SET) != offset ||
-			write(fd, p_buffer, size) != (ssize_t)size) {
-		close(fd);
-		printf("=> ERROR: Couldn't seek & write\n");
+	if (pwritev2(fd, iov, iov_count, offset, durability_rw_flags()) != (ssize_t)size) {
+		printf("=> ERROR: Couldn't pwritev %" PRIu64 " bytes at %" PRIu64 "\n", size, offset);
 		return false;
 	}
 
-	//uint64_t stop_ns = cf_getns();
+	readahead_invalidate(offset, size);
+
 	return true;
 }
 
@@ -761,7 +3693,15 @@ static bool discover_num_blocks(device* p_device) {
 	g_fd_device = fd;
 	uint64_t device_bytes = 0;
 
-	ioctl(fd, BLKGETSIZE64, &device_bytes);
+	if (ioctl(fd, BLKGETSIZE64, &device_bytes) != 0) {
+		// Not a block device - a preallocated file works too, e.g. for benchmarks.
+		struct stat file_stat;
+
+		if (fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode)) {
+			device_bytes = file_stat.st_size;
+		}
+	}
+
 	p_device->num_large_blocks = device_bytes / g_large_block_ops_bytes;
 	p_device->min_op_bytes = discover_min_op_bytes(fd, p_device->name);
 
@@ -787,18 +3727,68 @@ static bool discover_num_blocks(device* p_device) {
 		fprintf(g_output_file, "__________________________________________\n");
 	}
 
-	if (g_ref_tab_columns)
-	{
-		if (!g_device->ref_tab)
-		{
-			g_device->ref_tab = malloc((g_device->num_read_offsets * g_ref_tab_columns) / 8);
-			memset(g_device->ref_tab, 0, sizeof(g_device->ref_tab));
-			printf("Table of Reference created(%"PRIu64")!\n", (g_device->num_read_offsets * g_ref_tab_columns) / 64);
+	return true;
+}
+
+//------------------------------------------------
+// Create the table of reference for sector divisions.
+//
+static bool create_ref_tab(device* p_device) {
+	if (! g_ref_tab_columns) {
+		return false;
+	}
+
+	if (! p_device->ref_tab.words) {
+		if (! ref_map_init(&p_device->ref_tab, p_device->num_read_offsets * g_ref_tab_columns,
+				g_ref_map_compressed)) {
+			return false;
 		}
-	}else{
+		ref_map_set_geometry(&p_device->ref_tab,
+				(g_large_block_ops_bytes / p_device->read_bytes) * g_ref_tab_columns, g_ref_tab_columns);
+		printf("Table of Reference created(%"PRIu64" bytes)!\n", ref_map_bytes(&p_device->ref_tab));
+	}
+
+	return true;
+}
+
+//------------------------------------------------
+// Carve the device into one region per size class.
+//
+static bool create_size_classes(device* p_device) {
+	uint64_t next_block = 0;
+	uint32_t c;
+
+	p_device->classes = calloc(NUM_SIZE_CLASSES, sizeof(size_class));
+
+	if (! p_device->classes) {
 		return false;
 	}
 
+	for (c = 0; c < NUM_SIZE_CLASSES; c++) {
+		size_class* cls = &p_device->classes[c];
+		uint64_t num_blocks = (p_device->num_large_blocks * SIZE_CLASS_SHARES[c]) / 100;
+
+		// Give any rounding leftovers to the last class.
+		if (c == NUM_SIZE_CLASSES - 1) {
+			num_blocks = p_device->num_large_blocks - next_block;
+		}
+
+		cls->slot_bytes = SIZE_CLASS_BYTES[c];
+		cls->share = SIZE_CLASS_SHARES[c];
+		cls->base_offset = next_block * g_large_block_ops_bytes;
+		cls->num_slots = (num_blocks * g_large_block_ops_bytes) / cls->slot_bytes;
+		pthread_mutex_init(&cls->lock, NULL);
+
+		if (! ref_map_init(&cls->slots, cls->num_slots, g_ref_map_compressed)) {
+			return false;
+		}
+		ref_map_set_geometry(&cls->slots, g_large_block_ops_bytes / cls->slot_bytes,
+				p_device->min_op_bytes / cls->slot_bytes);
+
+		next_block += num_blocks;
+	}
+
+	p_device->num_classes = NUM_SIZE_CLASSES;
 	return true;
 }
 
@@ -837,19 +3827,72 @@ static uint64_t discover_min_op_bytes(int fd, const char *name) {
 //
 static void prep_to_sector_div(uint64_t offset, uint32_t division, void* dest, char* message, uint32_t write_size){
 	
-	if (! read_from_device(g_device, offset, g_device->read_bytes, dest)){
+	if (! read_sector(offset, dest)){
 		printf("=> ERROR read op. PREP_TO_SECTOR. Offset: %" PRIu64 "\n", offset);
 		return;
 	}
 	else{
-		int i, sector_div = g_device->read_bytes/g_ref_tab_columns;
-		memset(dest+(sector_div*division), '\0', sector_div);
+		patch_sector_div(dest, division, message, write_size);
+	}
+}
+
+//------------------------------------------------
+// Replace one division of a sector buffer with a message.
+//
+static void patch_sector_div(void* dest, uint32_t division, char* message, uint32_t write_size){
+	int sector_div = g_device->read_bytes/g_ref_tab_columns;
+	memset(dest+(sector_div*division), '\0', sector_div);
+
+	if (g_checksums){
+		seal_sector_div(dest+(sector_div*division), sector_div, message, write_size);
+		return;
+	}
+
+	if (write_size > 0 && write_size < sector_div){
+		strncpy(dest+(sector_div*division), message, write_size);
+	}else if(write_size >= sector_div)
+	{strncpy(dest+(sector_div*division), message, sector_div - 1);}
+}
+
+//------------------------------------------------
+// Fill a zeroed division with a header and the message, up to its first NUL.
+//
+static void seal_sector_div(uint8_t* div, uint32_t sector_div, const char* message, uint32_t write_size){
+	subsector_header header;
+	uint32_t len = sector_div > SUBSECTOR_HEADER_BYTES ? sector_div - SUBSECTOR_HEADER_BYTES : 0;
+
+	len = strnlen(message, write_size < len ? write_size : len);
+	memcpy(div + SUBSECTOR_HEADER_BYTES, message, len);
+
+	header.len_flags = ((uint32_t)SUBSECTOR_MAGIC << 24) | len;
+	header.crc = crc32c(crc32c(0, &header.len_flags, sizeof(uint32_t)), div + SUBSECTOR_HEADER_BYTES, len);
+	memcpy(div, &header, sizeof(header));
+}
+
+//------------------------------------------------
+// Find the payload of a division, verifying its header when checksums are on.
+//
+static raw_status open_sector_div(const uint8_t* div, uint32_t sector_div, const uint8_t** payload, uint32_t* len){
+	subsector_header header;
+
+	if (! g_checksums){
+		*payload = div;
+		*len = sector_div;
+		return RAW_OK;
+	}
 
-		if (write_size > 0 && write_size < sector_div){
-			strncpy(dest+(sector_div*division), message, write_size);
-		}else if(write_size >= sector_div)
-		{strncpy(dest+(sector_div*division), message, sector_div - 1);}
+	memcpy(&header, div, sizeof(header));
+	*payload = div + SUBSECTOR_HEADER_BYTES;
+	*len = header.len_flags & SUBSECTOR_LEN_MASK;
+
+	if ((header.len_flags >> 24) != SUBSECTOR_MAGIC || *len + SUBSECTOR_HEADER_BYTES > sector_div ||
+			crc32c(crc32c(0, &header.len_flags, sizeof(uint32_t)), *payload, *len) != header.crc){
+		thread_stats()->corrupt++;
+		*len = 0;
+		return RAW_ERR_CORRUPT;
 	}
+
+	return RAW_OK;
 }
 
 // static bool show_sector_ref(uint64_t sector, uint32_t division){
@@ -863,25 +3906,23 @@ static void prep_to_sector_div(uint64_t offset, uint32_t division, void* dest, c
 //
 static bool is_sector_free(uint64_t sector, uint32_t division){
 	if (division < g_ref_tab_columns && division >= 0){
-		uint64_t ref_tab_long = *(g_device->ref_tab + ((sector*g_ref_tab_columns+division) / (sizeof(uint64_t)*8)));
-		uint32_t long_bit = (sector * g_ref_tab_columns + division) % (sizeof(uint64_t)*8);
-		if (!(ref_tab_long & ((uint64_t)0b1 << long_bit))){
-			return true;
-		}
+		return ! ref_map_test(&g_device->ref_tab, sector * g_ref_tab_columns + division);
 	}
 	return false;	
 }
 
 //------------------------------------------------
-// Set sector on reference table
+// Set sector on reference table. Returns false if the bit couldn't be set
+// (a compressed map out of memory).
 //
-static void add_sector_ref(uint64_t sector, uint32_t division){
+static bool add_sector_ref(uint64_t sector, uint32_t division){
 	if (division < g_ref_tab_columns && division >= 0){
+		uint64_t bit = sector * g_ref_tab_columns + division;
 
-		uint32_t long_bit = (sector * g_ref_tab_columns + division) % (sizeof(uint64_t)*8);
-		printf("%"PRIu32"\n", long_bit);
-		*(g_device->ref_tab + ((sector*g_ref_tab_columns+division) / (sizeof(uint64_t)*8))) |= ((uint64_t)0b1 << long_bit);
+		// Not changed by this call is fine if someone else set it.
+		return ref_map_set(&g_device->ref_tab, bit) || ref_map_test(&g_device->ref_tab, bit);
 	}
+	return false;
 }
 
 //------------------------------------------------
@@ -889,9 +3930,477 @@ static void add_sector_ref(uint64_t sector, uint32_t division){
 //
 static void erase_sector_ref(uint64_t sector, uint32_t division){
 	if (division < g_ref_tab_columns && division >= 0){
-		uint32_t long_bit = (sector * g_ref_tab_columns + division) % (sizeof(uint64_t)*8);
-		*(g_device->ref_tab + ((sector*g_ref_tab_columns) / (sizeof(uint64_t)*8))) &= ~((uint64_t)0b1 << long_bit);
+		ref_map_clear(&g_device->ref_tab, sector * g_ref_tab_columns + division);
+	}
+}
+
+//------------------------------------------------
+// Allocate a zeroed bitmap, dense or chunked.
+//
+static bool ref_map_init(ref_map* map, uint64_t num_bits, bool compressed){
+	uint32_t shard;
+
+	memset(map, 0, sizeof(ref_map));
+	map->num_bits = num_bits;
+	map->compressed = compressed;
+	map->block_bits = 1;
+	map->sector_bits = 1;
+	map->cursors = (place_cursor*)cf_valloc(PLACEMENT_SHARDS * sizeof(place_cursor));
+
+	if (! map->cursors) {
+		return false;
+	}
+	memset(map->cursors, 0, PLACEMENT_SHARDS * sizeof(place_cursor));
+
+	// Shards start spread over the map, not all at bit 0.
+	for (shard = 0; shard < PLACEMENT_SHARDS; shard++) {
+		map->cursors[shard].bit = (uint64_t)((unsigned __int128)shard * num_bits / PLACEMENT_SHARDS);
+	}
+
+	if (! compressed) {
+		map->words = calloc((num_bits + 63) / 64, sizeof(uint64_t));
+		return map->words != NULL;
+	}
+
+	// Every chunk starts empty, so only the per-chunk bookkeeping is resident.
+	map->num_chunks = (num_bits + REF_MAP_CHUNK_BITS - 1) / REF_MAP_CHUNK_BITS;
+	map->chunks = calloc(map->num_chunks, sizeof(uint64_t*));
+	map->chunk_set = calloc(map->num_chunks, sizeof(uint32_t));
+	pthread_mutex_init(&map->lock, NULL);
+	return map->chunks && map->chunk_set;
+}
+
+//------------------------------------------------
+// Number of bits covered by one chunk (the last may be short).
+//
+static inline uint32_t ref_chunk_bits(const ref_map* map, uint64_t chunk){
+	uint64_t left = map->num_bits - chunk * REF_MAP_CHUNK_BITS;
+	return left < REF_MAP_CHUNK_BITS ? (uint32_t)left : REF_MAP_CHUNK_BITS;
+}
+
+//------------------------------------------------
+// Give an all-0 or all-1 chunk real words so a single bit can change.
+//
+static uint64_t* ref_chunk_expand(ref_map* map, uint64_t chunk){
+	uint32_t bits = ref_chunk_bits(map, chunk);
+	uint64_t* words = calloc(REF_MAP_CHUNK_BITS / 64, sizeof(uint64_t));
+
+	if (! words) {
+		printf("=> ERROR: ref_map chunk calloc()\n");
+	}
+	else if (map->chunk_set[chunk] == bits) {
+		memset(words, 0xff, (bits / 64) * sizeof(uint64_t));
+		if (bits % 64) {
+			words[bits / 64] = ((uint64_t)1 << (bits % 64)) - 1;
+		}
+	}
+
+	map->chunks[chunk] = words;
+	return words;
+}
+
+//------------------------------------------------
+// Drop the words of a chunk that became all-0 or all-1.
+//
+static inline void ref_chunk_collapse(ref_map* map, uint64_t chunk){
+	if (map->chunk_set[chunk] == 0 || map->chunk_set[chunk] == ref_chunk_bits(map, chunk)) {
+		free(map->chunks[chunk]);
+		map->chunks[chunk] = NULL;
+	}
+}
+
+//------------------------------------------------
+// Find the first clear bit in [from, end) of a word array. Returns end if none.
+//
+static uint64_t words_next_free(const uint64_t* words, uint64_t from, uint64_t end){
+	uint64_t num_words = (end + 63) / 64;
+	uint64_t w = from / 64;
+
+	if (from >= end) {
+		return end;
+	}
+
+	// Mask off the bits below 'from' in the first word.
+	uint64_t free_bits = ~__atomic_load_n(&words[w], __ATOMIC_RELAXED) &
+			(~(uint64_t)0 << (from % 64));
+
+	while (! free_bits) {
+		if (++w >= num_words) {
+			return end;
+		}
+		free_bits = ~__atomic_load_n(&words[w], __ATOMIC_RELAXED);
+	}
+
+	uint64_t bit = w * 64 + __builtin_ctzll(free_bits);
+	return bit < end ? bit : end;
+}
+
+//------------------------------------------------
+// Check if a bit is set.
+//
+static inline bool ref_map_test(ref_map* map, uint64_t bit){
+	bool set;
+
+	if (bit >= map->num_bits) {
+		return false;
+	}
+
+	if (! map->compressed) {
+		return (__atomic_load_n(&map->words[bit / 64], __ATOMIC_RELAXED) >> (bit % 64)) & 1;
+	}
+
+	uint64_t chunk = bit / REF_MAP_CHUNK_BITS;
+	uint32_t pos = bit % REF_MAP_CHUNK_BITS;
+
+	pthread_mutex_lock(&map->lock);
+	set = map->chunks[chunk] ? (map->chunks[chunk][pos / 64] >> (pos % 64)) & 1 :
+			map->chunk_set[chunk] != 0;
+	pthread_mutex_unlock(&map->lock);
+
+	return set;
+}
+
+//------------------------------------------------
+// Set a bit, returning true if this call changed it.
+//
+static inline bool ref_map_set(ref_map* map, uint64_t bit){
+	uint64_t mask = (uint64_t)1 << (bit % 64);
+
+	if (bit >= map->num_bits) {
+		return false;
+	}
+
+	if (! map->compressed) {
+		if (__atomic_fetch_or(&map->words[bit / 64], mask, __ATOMIC_ACQ_REL) & mask) {
+			return false;
+		}
+		__atomic_fetch_add(&map->num_set, 1, __ATOMIC_RELAXED);
+		return true;
+	}
+
+	uint64_t chunk = bit / REF_MAP_CHUNK_BITS;
+	uint32_t pos = bit % REF_MAP_CHUNK_BITS;
+	uint64_t* words;
+	bool changed = false;
+
+	pthread_mutex_lock(&map->lock);
+
+	if (map->chunk_set[chunk] != ref_chunk_bits(map, chunk) &&
+			((words = map->chunks[chunk]) || (words = ref_chunk_expand(map, chunk))) &&
+			! (words[pos / 64] & mask)) {
+		words[pos / 64] |= mask;
+		map->chunk_set[chunk]++;
+		map->num_set++;
+		ref_chunk_collapse(map, chunk);
+		changed = true;
+	}
+
+	pthread_mutex_unlock(&map->lock);
+	return changed;
+}
+
+//------------------------------------------------
+// Clear a bit, returning true if this call changed it.
+//
+static inline bool ref_map_clear(ref_map* map, uint64_t bit){
+	uint64_t mask = (uint64_t)1 << (bit % 64);
+
+	if (bit >= map->num_bits) {
+		return false;
+	}
+
+	if (! map->compressed) {
+		if (! (__atomic_fetch_and(&map->words[bit / 64], ~mask, __ATOMIC_ACQ_REL) & mask)) {
+			return false;
+		}
+		__atomic_fetch_sub(&map->num_set, 1, __ATOMIC_RELAXED);
+		return true;
+	}
+
+	uint64_t chunk = bit / REF_MAP_CHUNK_BITS;
+	uint32_t pos = bit % REF_MAP_CHUNK_BITS;
+	uint64_t* words;
+	bool changed = false;
+
+	pthread_mutex_lock(&map->lock);
+
+	if (map->chunk_set[chunk] != 0 &&
+			((words = map->chunks[chunk]) || (words = ref_chunk_expand(map, chunk))) &&
+			(words[pos / 64] & mask)) {
+		words[pos / 64] &= ~mask;
+		map->chunk_set[chunk]--;
+		map->num_set--;
+		ref_chunk_collapse(map, chunk);
+		changed = true;
+	}
+
+	pthread_mutex_unlock(&map->lock);
+	return changed;
+}
+
+//------------------------------------------------
+// Find the first clear bit at or after 'from'. Returns num_bits if none.
+//
+static uint64_t ref_map_next_free(ref_map* map, uint64_t from){
+	uint64_t chunk, bit = map->num_bits;
+
+	if (! map->compressed) {
+		return words_next_free(map->words, from, map->num_bits);
+	}
+
+	pthread_mutex_lock(&map->lock);
+
+	// Full chunks are skipped without touching memory, empty ones answer at once.
+	for (chunk = from / REF_MAP_CHUNK_BITS; chunk < map->num_chunks; chunk++) {
+		uint64_t start = chunk * REF_MAP_CHUNK_BITS;
+		uint32_t bits = ref_chunk_bits(map, chunk);
+		uint32_t pos = from > start ? (uint32_t)(from - start) : 0;
+
+		if (map->chunk_set[chunk] == bits) {
+			continue;
+		}
+
+		if (! map->chunks[chunk]) {
+			bit = start + pos;
+			break;
+		}
+
+		if ((pos = words_next_free(map->chunks[chunk], pos, bits)) < bits) {
+			bit = start + pos;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&map->lock);
+	return bit;
+}
+
+//------------------------------------------------
+// Find the first set bit at or after 'from'. Returns num_bits if none.
+//
+static uint64_t ref_map_next_set(ref_map* map, uint64_t from){
+	uint64_t chunk, bit = map->num_bits;
+
+	if (! map->compressed) {
+		uint64_t num_words = (map->num_bits + 63) / 64;
+		uint64_t w = from / 64;
+
+		if (from >= map->num_bits) {
+			return map->num_bits;
+		}
+
+		uint64_t set_bits = __atomic_load_n(&map->words[w], __ATOMIC_RELAXED) &
+				(~(uint64_t)0 << (from % 64));
+
+		while (! set_bits) {
+			if (++w >= num_words) {
+				return map->num_bits;
+			}
+			set_bits = __atomic_load_n(&map->words[w], __ATOMIC_RELAXED);
+		}
+
+		bit = w * 64 + __builtin_ctzll(set_bits);
+		return bit < map->num_bits ? bit : map->num_bits;
+	}
+
+	pthread_mutex_lock(&map->lock);
+
+	// Empty chunks are skipped without touching memory, full ones answer at once.
+	for (chunk = from / REF_MAP_CHUNK_BITS; chunk < map->num_chunks; chunk++) {
+		uint64_t start = chunk * REF_MAP_CHUNK_BITS;
+		uint32_t bits = ref_chunk_bits(map, chunk);
+		uint32_t pos = from > start ? (uint32_t)(from - start) : 0;
+		uint32_t w;
+
+		if (map->chunk_set[chunk] == 0) {
+			continue;
+		}
+
+		if (! map->chunks[chunk]) {
+			bit = start + pos;
+			break;
+		}
+
+		for (w = pos / 64; w < (bits + 63) / 64; w++) {
+			uint64_t set_bits = map->chunks[chunk][w];
+
+			if (w == pos / 64) {
+				set_bits &= ~(uint64_t)0 << (pos % 64);
+			}
+			if (set_bits) {
+				bit = start + (uint64_t)w * 64 + __builtin_ctzll(set_bits);
+				break;
+			}
+		}
+		if (bit < map->num_bits) {
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&map->lock);
+	return bit;
+}
+
+//------------------------------------------------
+// Bytes of memory held by a bitmap.
+//
+static uint64_t ref_map_bytes(const ref_map* map){
+	uint64_t chunk, bytes;
+
+	if (! map->compressed) {
+		return ((map->num_bits + 63) / 64) * sizeof(uint64_t);
+	}
+
+	bytes = map->num_chunks * (sizeof(uint64_t*) + sizeof(uint32_t));
+	for (chunk = 0; chunk < map->num_chunks; chunk++) {
+		if (map->chunks[chunk]) {
+			bytes += REF_MAP_CHUNK_BITS / 8;
+		}
+	}
+	return bytes;
+}
+
+//------------------------------------------------
+// Find and set a clear bit, starting where the placement policy says.
+//
+static bool ref_map_claim(ref_map* map, uint64_t* p_bit){
+	uint64_t start = ref_map_place_start(map);
+	uint64_t end = map->num_bits;
+	uint64_t bit = start;
+
+	// Another thread may take the bit between the scan and the set.
+	while (true) {
+		if ((bit = ref_map_next_free(map, bit)) >= end) {
+			if (end == start || start == 0) {
+				return false;
+			}
+			// Wrap once and search the part before the starting point.
+			end = start;
+			bit = 0;
+			continue;
+		}
+		if (ref_map_set(map, bit)) {
+			ref_map_placed(map, bit);
+			*p_bit = bit;
+			return true;
+		}
+		bit++;
+	}
+}
+
+//------------------------------------------------
+// Get the calling thread's placement shard.
+//
+static inline uint32_t thread_shard(){
+	if (t_shard == PLACEMENT_SHARDS) {
+		t_shard = __atomic_fetch_add(&g_next_shard, 1, __ATOMIC_RELAXED) % PLACEMENT_SHARDS;
+	}
+	return t_shard;
+}
+
+//------------------------------------------------
+// Set the bitmap's large block and sector sizes, in bits.
+//
+static void ref_map_set_geometry(ref_map* map, uint64_t block_bits, uint64_t sector_bits){
+	map->block_bits = block_bits ? block_bits : 1;
+	map->sector_bits = sector_bits ? sector_bits : 1;
+}
+
+//------------------------------------------------
+// Bit a search should start from under the current placement policy.
+//
+static uint64_t ref_map_place_start(ref_map* map){
+	uint64_t bit = 0;
+
+	switch (g_placement_policy) {
+	case PLACEMENT_NEXT_FIT:
+		bit = map->cursors[thread_shard()].bit;
+		break;
+	case PLACEMENT_ROUND_ROBIN:
+		bit = (__atomic_fetch_add(&map->next_block, 1, __ATOMIC_RELAXED) * map->block_bits);
+		break;
+	case PLACEMENT_LOCALITY:
+		bit = map->cursors[thread_shard()].bit;
+		bit -= bit % map->sector_bits;
+		break;
+	default:
+		break;
 	}
+
+	return map->num_bits ? bit % map->num_bits : 0;
+}
+
+//------------------------------------------------
+// Remember the shard's last placement.
+//
+static void ref_map_placed(ref_map* map, uint64_t bit){
+	if (g_placement_policy == PLACEMENT_NEXT_FIT) {
+		map->cursors[thread_shard()].bit = bit + 1;
+	}
+	else if (g_placement_policy == PLACEMENT_LOCALITY) {
+		map->cursors[thread_shard()].bit = bit;
+	}
+}
+
+//------------------------------------------------
+// Read or write one record slot. Slots smaller than the device's minimum
+// op size share a block with their neighbours, so writes read it first.
+//
+static int32_t record_io(size_class* cls, uint64_t slot, char* buffer, uint32_t size, bool write){
+	uint32_t min_op = g_device->min_op_bytes;
+	uint64_t offset = cls->base_offset + slot * cls->slot_bytes;
+	uint64_t io_offset = offset - (offset % min_op);
+	uint32_t slot_pos = (uint32_t)(offset - io_offset);
+	uint32_t io_bytes = ((slot_pos + cls->slot_bytes + min_op - 1) / min_op) * min_op;
+	bool shared = io_bytes != cls->slot_bytes;
+	uint32_t copy = size < cls->slot_bytes ? size : cls->slot_bytes;
+	int32_t result = (int32_t)copy;
+	uint8_t* p_buffer = cf_valloc(io_bytes);
+
+	if (! p_buffer) {
+		printf("=> ERROR: record buffer cf_valloc()\n");
+		return RAW_ERR_IO;
+	}
+
+	if (write && shared) {
+		pthread_mutex_lock(&cls->lock);
+	}
+
+	bool admitted = qos_begin(write ? QOS_WRITE : QOS_READ, io_bytes, write);
+
+	if (write) {
+		if (shared && ! read_from_device(g_device, io_offset, io_bytes, p_buffer)) {
+			result = RAW_ERR_IO;
+		}
+		else {
+			memset(p_buffer + slot_pos, 0, cls->slot_bytes);
+			memcpy(p_buffer + slot_pos, buffer, copy);
+			if (! write_to_device(g_device, io_offset, io_bytes, p_buffer)) {
+				result = RAW_ERR_IO;
+			}
+		}
+	}
+	else {
+		if (! read_from_device(g_device, io_offset, io_bytes, p_buffer)) {
+			result = RAW_ERR_IO;
+		}
+		else {
+			memcpy(buffer, p_buffer + slot_pos, copy);
+		}
+	}
+
+	qos_end(write ? QOS_WRITE : QOS_READ, admitted);
+
+	if (write && shared) {
+		pthread_mutex_unlock(&cls->lock);
+	}
+
+	if (write && result >= 0 && ! durability_commit()) {
+		result = RAW_ERR_IO;
+	}
+
+	free(p_buffer);
+	return result;
 }
 
 //------------------------------------------------
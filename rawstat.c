@@ -0,0 +1,159 @@
+/*
+	S1Search Research 
+	Raw Device Access: rawstat - poll the counters of a running process
+
+	Usage: ./rawstat pid [interval(seconds)]
+	Maps the process's counters segment read-only, so polling never slows it.
+*/
+
+//======================================================================================================
+// Includes
+//
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "rawstat.h"
+
+//======================================================================================================
+// Constants
+//
+const char* const OP_NAMES[] = {
+	"read",
+	"write",
+	"erase"
+};
+
+//======================================================================================================
+// Main
+//
+int main(int argc, char* argv[]) {
+	if (argc < 2) {
+		printf("=> ERROR: Wrong number of arguments!\nUsage: ./rawstat pid [interval(seconds)]\n");
+		return -1;
+	}
+
+	char shm_name[64];
+	uint32_t interval = argc > 2 ? (uint32_t)atoi(argv[2]) : 1;
+	if (! interval) {
+		interval = 1;
+	}
+	snprintf(shm_name, sizeof(shm_name), RAWSTAT_SHM_PREFIX "%s", argv[1]);
+
+	pid_t pid = (pid_t)atoi(argv[1]);
+
+	if (pid > 0 && kill(pid, 0) == -1 && errno == ESRCH) {
+		// Killed before it could clean up - nothing to poll, so drop the segment.
+		printf("=> ERROR: process %s is gone, removing its stale counters segment\n", argv[1]);
+		shm_unlink(shm_name);
+		return -1;
+	}
+
+	int fd = shm_open(shm_name, O_RDONLY, 0);
+
+	if (fd == -1) {
+		printf("=> ERROR: Couldn't open counters segment %s\n", shm_name);
+		return -1;
+	}
+
+	const rawstat_segment* seg = mmap(NULL, sizeof(rawstat_segment), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (seg == MAP_FAILED || seg->magic != RAWSTAT_MAGIC || seg->version != RAWSTAT_VERSION) {
+		printf("=> ERROR: %s is not a version %d counters segment\n", shm_name, RAWSTAT_VERSION);
+		return -1;
+	}
+
+	rawstat_snapshot prev, cur;
+	rawstat_collect(seg, &prev);
+
+	while (true) {
+		sleep(interval);
+		if (kill(pid, 0) == -1 && errno == ESRCH) {
+			printf("-> pid %d has exited\n", (int)pid);
+			break;
+		}
+		rawstat_collect(seg, &cur);
+
+		printf("-> pid %d  inflight %" PRIu64 "  queued %" PRIu64 "  bitmap %" PRIu64 "/%" PRIu64
+				" (%" PRIu64 " bytes)\n", seg->pid, cur.inflight, cur.queued_writes,
+				cur.bitmap_set, cur.bitmap_bits, cur.bitmap_bytes);
+
+		for (int op = 0; op < RAWSTAT_NUM_OPS; op++) {
+			uint64_t lat[RAWSTAT_LAT_BUCKETS];
+
+			for (int b = 0; b < RAWSTAT_LAT_BUCKETS; b++) {
+				lat[b] = cur.lat[op][b] - prev.lat[op][b];
+			}
+
+			printf(" - %-5s %10" PRIu64 " ops/s %12" PRIu64 " B/s %6" PRIu64 " err"
+					"  p50 <%" PRIu64 " us  p99 <%" PRIu64 " us  p99.9 <%" PRIu64 " us\n",
+					OP_NAMES[op],
+					(cur.ops[op] - prev.ops[op]) / interval,
+					(cur.bytes[op] - prev.bytes[op]) / interval,
+					cur.errors[op] - prev.errors[op],
+					rawstat_percentile_ns(lat, 50) / 1000,
+					rawstat_percentile_ns(lat, 99) / 1000,
+					rawstat_percentile_ns(lat, 99.9) / 1000);
+		}
+
+		printf(" - not found %" PRIu64 "  conflicts %" PRIu64 "  corrupt %" PRIu64 "  staged hits %" PRIu64
+				"  flushes %" PRIu64 " (%" PRIu64 " requests, %" PRIu64 " sectors)\n",
+				cur.not_found - prev.not_found, cur.conflicts - prev.conflicts, cur.corrupt - prev.corrupt,
+				cur.staged_hits - prev.staged_hits, cur.flushes - prev.flushes,
+				cur.flush_requests - prev.flush_requests, cur.flush_sectors - prev.flush_sectors);
+
+		uint64_t packs = cur.codec_compress_ops - prev.codec_compress_ops;
+		uint64_t unpacks = cur.codec_decompress_ops - prev.codec_decompress_ops;
+
+		if (packs || unpacks) {
+			uint64_t stored = cur.codec_stored_bytes - prev.codec_stored_bytes;
+
+			printf(" - codec ratio %.2f  compress %" PRIu64 " ns/op  decompress %" PRIu64 " ns/op\n",
+					stored ? (double)(cur.codec_raw_bytes - prev.codec_raw_bytes) / stored : 0.0,
+					packs ? (cur.codec_compress_ns - prev.codec_compress_ns) / packs : 0,
+					unpacks ? (cur.codec_decompress_ns - prev.codec_decompress_ns) / unpacks : 0);
+		}
+
+		uint64_t polls = cur.poll_ops - prev.poll_ops;
+		uint64_t degraded = cur.poll_degraded - prev.poll_degraded;
+
+		if (polls || degraded) {
+			printf(" - polled %" PRIu64 " ops/s  spinning %.1f%% of a core  slept %" PRIu64
+					"  over budget %" PRIu64 "\n", polls / interval,
+					(cur.poll_spin_ns - prev.poll_spin_ns) / (interval * 1e7),
+					cur.poll_sleeps - prev.poll_sleeps, degraded);
+		}
+
+		uint64_t syncs = cur.durable_syncs - prev.durable_syncs;
+
+		if (syncs) {
+			uint64_t grouped = cur.durable_sync_writes - prev.durable_sync_writes;
+
+			printf(" - durability %" PRIu64 " flushes/s  %.1f writes/flush  waiting %" PRIu64 " us/write\n",
+					syncs / interval, (double)grouped / syncs,
+					grouped ? (cur.durable_wait_ns - prev.durable_wait_ns) / grouped / 1000 : 0);
+		}
+
+		uint64_t issued = cur.ra_issued - prev.ra_issued;
+		uint64_t ra_hits = cur.ra_hits - prev.ra_hits;
+
+		if (issued || ra_hits) {
+			printf(" - read-ahead %" PRIu64 " sectors/s  hits %" PRIu64 "/s (%" PRIu64 " late)  wasted %" PRIu64 "\n",
+					issued / interval, ra_hits / interval, cur.ra_late - prev.ra_late,
+					cur.ra_wasted - prev.ra_wasted);
+		}
+		fflush(stdout);
+
+		prev = cur;
+	}
+
+	return 0;
+}
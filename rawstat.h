@@ -0,0 +1,207 @@
+#pragma once
+
+#include <stdint.h>
+
+// Layout of the counters segment shared between the library and rawstat.
+// Each thread owns one cache-line aligned slot and is its only writer, so
+// counting never bounces lines between cores; readers sum all the slots.
+// An exiting thread's counts are folded into 'retired' and its slot handed
+// to the next new thread, under 'retire_seq' so readers never see a count
+// in both places or in neither.
+
+#define RAWSTAT_MAGIC 0x3154415453574152ULL // "RAWSTAT1"
+#define RAWSTAT_VERSION 7
+#define RAWSTAT_SHM_PREFIX "/rawstat."
+#define RAWSTAT_MAX_THREADS 256
+#define RAWSTAT_LAT_BUCKETS 32 // bucket b counts ops taking [2^b, 2^(b+1)) ns
+
+typedef enum {
+	RAWSTAT_OP_READ = 0,
+	RAWSTAT_OP_WRITE,
+	RAWSTAT_OP_ERASE,
+	RAWSTAT_NUM_OPS
+} rawstat_op;
+
+typedef struct _rawstat_thread {
+	uint64_t ops[RAWSTAT_NUM_OPS];
+	uint64_t bytes[RAWSTAT_NUM_OPS];
+	uint64_t errors[RAWSTAT_NUM_OPS];
+	uint64_t inflight;
+	uint64_t not_found; // reads of sub-sectors that are not referenced
+	uint64_t conflicts; // writes to sub-sectors that are already referenced
+	uint64_t corrupt; // reads failing checksum verification
+	uint64_t staged_hits; // reads served from the write queue
+	uint64_t flushes;
+	uint64_t flush_requests; // vectored writes issued by flushes
+	uint64_t flush_sectors;
+	uint64_t codec_raw_bytes; // putRecordJNA bytes offered to the compressor
+	uint64_t codec_stored_bytes; // and what was stored for them
+	uint64_t codec_compress_ops;
+	uint64_t codec_compress_ns;
+	uint64_t codec_decompress_ops;
+	uint64_t codec_decompress_ns;
+	uint64_t poll_ops; // device ops completed by polling
+	uint64_t poll_spin_ns; // CPU time spent spinning for them
+	uint64_t poll_sleeps; // hybrid ops that outlasted their spin and slept
+	uint64_t poll_degraded; // ops sent to interrupts by the CPU budget
+	uint64_t durable_syncs; // drive cache flushes
+	uint64_t durable_sync_writes; // writes (or syncJNA calls) they served
+	uint64_t durable_wait_ns; // time those spent waiting
+	uint64_t ra_issued; // sectors queued for read-ahead
+	uint64_t ra_hits; // reads served from the read-ahead pool
+	uint64_t ra_late; // of those, reads that waited for the prefetch
+	uint64_t ra_wasted; // prefetched sectors dropped unread
+	uint64_t lat[RAWSTAT_NUM_OPS][RAWSTAT_LAT_BUCKETS];
+} __attribute__((aligned(64))) rawstat_thread;
+
+typedef struct _rawstat_segment {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t num_threads; // slots ever handed out
+	int32_t pid;
+	uint32_t retire_seq; // odd while a slot is being folded into 'retired'
+	// Gauges, republished a few times a second.
+	uint64_t queued_writes;
+	uint64_t bitmap_bits;
+	uint64_t bitmap_set;
+	uint64_t bitmap_bytes;
+	rawstat_thread retired; // totals of threads that have exited
+	rawstat_thread threads[RAWSTAT_MAX_THREADS];
+} rawstat_segment;
+
+// Totals over all threads, as returned by statsJNA.
+typedef struct _rawstat_snapshot {
+	uint64_t ops[RAWSTAT_NUM_OPS];
+	uint64_t bytes[RAWSTAT_NUM_OPS];
+	uint64_t errors[RAWSTAT_NUM_OPS];
+	uint64_t inflight;
+	uint64_t not_found;
+	uint64_t conflicts;
+	uint64_t corrupt;
+	uint64_t staged_hits;
+	uint64_t flushes;
+	uint64_t flush_requests;
+	uint64_t flush_sectors;
+	uint64_t codec_raw_bytes;
+	uint64_t codec_stored_bytes;
+	uint64_t codec_compress_ops;
+	uint64_t codec_compress_ns;
+	uint64_t codec_decompress_ops;
+	uint64_t codec_decompress_ns;
+	uint64_t poll_ops;
+	uint64_t poll_spin_ns;
+	uint64_t poll_sleeps;
+	uint64_t poll_degraded;
+	uint64_t durable_syncs;
+	uint64_t durable_sync_writes;
+	uint64_t durable_wait_ns;
+	uint64_t ra_issued;
+	uint64_t ra_hits;
+	uint64_t ra_late;
+	uint64_t ra_wasted;
+	uint64_t queued_writes;
+	uint64_t bitmap_bits;
+	uint64_t bitmap_set;
+	uint64_t bitmap_bytes;
+	uint64_t lat[RAWSTAT_NUM_OPS][RAWSTAT_LAT_BUCKETS];
+} rawstat_snapshot;
+
+static inline uint64_t
+rawstat_load(const uint64_t* p)
+{
+	return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static inline void
+rawstat_add(const rawstat_thread* th, rawstat_snapshot* snap)
+{
+	uint32_t op, b;
+
+	for (op = 0; op < RAWSTAT_NUM_OPS; op++) {
+		snap->ops[op] += rawstat_load(&th->ops[op]);
+		snap->bytes[op] += rawstat_load(&th->bytes[op]);
+		snap->errors[op] += rawstat_load(&th->errors[op]);
+		for (b = 0; b < RAWSTAT_LAT_BUCKETS; b++) {
+			snap->lat[op][b] += rawstat_load(&th->lat[op][b]);
+		}
+	}
+	snap->inflight += rawstat_load(&th->inflight);
+	snap->not_found += rawstat_load(&th->not_found);
+	snap->conflicts += rawstat_load(&th->conflicts);
+	snap->corrupt += rawstat_load(&th->corrupt);
+	snap->staged_hits += rawstat_load(&th->staged_hits);
+	snap->flushes += rawstat_load(&th->flushes);
+	snap->flush_requests += rawstat_load(&th->flush_requests);
+	snap->flush_sectors += rawstat_load(&th->flush_sectors);
+	snap->codec_raw_bytes += rawstat_load(&th->codec_raw_bytes);
+	snap->codec_stored_bytes += rawstat_load(&th->codec_stored_bytes);
+	snap->codec_compress_ops += rawstat_load(&th->codec_compress_ops);
+	snap->codec_compress_ns += rawstat_load(&th->codec_compress_ns);
+	snap->codec_decompress_ops += rawstat_load(&th->codec_decompress_ops);
+	snap->codec_decompress_ns += rawstat_load(&th->codec_decompress_ns);
+	snap->poll_ops += rawstat_load(&th->poll_ops);
+	snap->poll_spin_ns += rawstat_load(&th->poll_spin_ns);
+	snap->poll_sleeps += rawstat_load(&th->poll_sleeps);
+	snap->poll_degraded += rawstat_load(&th->poll_degraded);
+	snap->durable_syncs += rawstat_load(&th->durable_syncs);
+	snap->durable_sync_writes += rawstat_load(&th->durable_sync_writes);
+	snap->durable_wait_ns += rawstat_load(&th->durable_wait_ns);
+	snap->ra_issued += rawstat_load(&th->ra_issued);
+	snap->ra_hits += rawstat_load(&th->ra_hits);
+	snap->ra_late += rawstat_load(&th->ra_late);
+	snap->ra_wasted += rawstat_load(&th->ra_wasted);
+}
+
+static inline void
+rawstat_collect(const rawstat_segment* seg, rawstat_snapshot* snap)
+{
+	uint32_t num_threads, seq, t;
+
+	do {
+		while ((seq = __atomic_load_n(&seg->retire_seq, __ATOMIC_ACQUIRE)) & 1) {
+		}
+
+		num_threads = __atomic_load_n(&seg->num_threads, __ATOMIC_ACQUIRE);
+		if (num_threads > RAWSTAT_MAX_THREADS) {
+			num_threads = RAWSTAT_MAX_THREADS;
+		}
+
+		*snap = (rawstat_snapshot){ 0 };
+		rawstat_add(&seg->retired, snap);
+
+		for (t = 0; t < num_threads; t++) {
+			rawstat_add(&seg->threads[t], snap);
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&seg->retire_seq, __ATOMIC_RELAXED) != seq);
+
+	snap->queued_writes = rawstat_load(&seg->queued_writes);
+	snap->bitmap_bits = rawstat_load(&seg->bitmap_bits);
+	snap->bitmap_set = rawstat_load(&seg->bitmap_set);
+	snap->bitmap_bytes = rawstat_load(&seg->bitmap_bytes);
+}
+
+// Upper bound, in ns, of the bucket holding the given percentile.
+static inline uint64_t
+rawstat_percentile_ns(const uint64_t* lat, double pct)
+{
+	uint64_t total = 0, count = 0, target;
+	uint32_t b;
+
+	for (b = 0; b < RAWSTAT_LAT_BUCKETS; b++) {
+		total += lat[b];
+	}
+	if (! total) {
+		return 0;
+	}
+
+	target = (uint64_t)(pct * total / 100.0);
+	for (b = 0; b < RAWSTAT_LAT_BUCKETS; b++) {
+		count += lat[b];
+		if (count > target) {
+			break;
+		}
+	}
+	return (uint64_t)2 << b;
+}